@@ -1,12 +1,223 @@
+#include "FBHanoi.h"
+
 #include <iostream>
+#include <string>
 #include <vector>
 #include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <functional>
+#include <chrono>
+
+#include <stdint.h>
+
+#include <cstring> // for memcpy, strncpy
+#include <cstdio>  // for fprintf
+
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close, getpid
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+
+// the vectorized move generator packs eight 32-bit states into an AVX2
+// register; define FBHANOI_NO_SIMD to leave it out
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(FBHANOI_WIDE_STATE) && \
+        !defined(FBHANOI_NO_SIMD)
+#define FBHANOI_AVX2_KERNEL
+#include <immintrin.h>
+#endif
+
+// define FBHANOI_USE_MPI (and build with mpicxx) to run --search distributed
+// across MPI processes instead of threads
+#ifdef FBHANOI_USE_MPI
+#include <mpi.h>
+#endif
+
+// largest state space (K^N) for which the vertex lookup uses a dense array
+// indexed by state rank; bigger spaces fall back to a hash map
+#define MAX_DENSE_INDEX_STATES (1 << 22)
+
+// largest state space the parallel search will allocate rank-indexed
+// visited bits and parent moves for (about 4.5 GB at the limit)
+#define MAX_PARALLEL_SEARCH_STATES (1ull << 32)
+
+// the same limit for the serial rank-indexed search (--search lean)
+#define MAX_LEAN_SEARCH_STATES (1ull << 32)
+
+// successors the external search buffers before writing a sorted run, and
+// where it puts its layer files by default
+#define EXTERNAL_RUN_STATES (1 << 22)
+#define DEFAULT_WORK_DIR "/tmp"
+
+// in-process nodes a distributed search runs by default
+#define DEFAULT_DISTRIBUTED_NODES 4
+
+// frontier states a parallel search thread claims at a time
+#define PARALLEL_SEARCH_CHUNK 256
+
+// states handed to one ExpandStates call
+#define EXPAND_BATCH_STATES 64
+
+// puzzle sizes covered by the precomputed distance tables (the constraint
+// range of the problem statement). Distances stay below 256 in this range.
+#define MAX_TABLE_DISKS 8
+#define MIN_TABLE_PEGS 3
+#define MAX_TABLE_PEGS 5
+
+// puzzle sizes the graph search has compile-time specialized kernels for
+// (the exploreKernels table lists them explicitly); others use generic code
+#define MAX_FIXED_DISKS 8
+#define MIN_FIXED_PEGS 3
+#define MAX_FIXED_PEGS 5
+
+// default number of disks per pattern when estimating distances from pattern
+// databases (MAX_PATTERN_DISKS at most)
+#define DEFAULT_PATTERN_DISKS 6
+
+// most pegs for which the Frame-Stewart recursion is known to be minimal, and
+// so answers "one peg to another" puzzles directly
+#define MAX_CLOSED_FORM_PEGS 4
+
+// number of solved puzzles the in-process solution cache remembers
+#define DEFAULT_CACHE_ENTRIES 4096
+
+// search statistics counters (see SearchStats); FBHANOI_NO_STATS removes them
+#ifdef FBHANOI_NO_STATS
+#define COUNT_STAT(counter, n) ((void)0)
+#define PEAK_STAT(peak, n) ((void)0)
+#else
+#define COUNT_STAT(counter, n) ((counter) += (n))
+#define PEAK_STAT(peak, n) ((peak) = std::max((peak), (uint64_t)(n)))
+#endif
+
+// every peg can move its top disk to at most K-1 others
+#define MAX_MOVES_PER_STATE (StateCodec::kMaxPegs * (StateCodec::kMaxPegs - 1))
+
+// a move squeezed into one byte, using a state's bits per peg for each end
+typedef uint8_t PackedMove;
+
+static inline PackedMove PackMove(const Move& move)
+{
+    return (move.fromPeg << StateCodec::kBitsPerDisk) | move.toPeg;
+}
+
+static inline Move UnpackMove(PackedMove packed)
+{
+    Move move;
+    move.fromPeg = packed >> StateCodec::kBitsPerDisk;
+    move.toPeg = packed & StateCodec::kPegMask;
+    return move;
+}
+
+typedef uint64_t StateRank;
+
+//==============================================================================
+//
+// Rank State
+//
+// Perfect base-K ranking of a packed state: peg(i) * K^i summed over all
+// disks. Every state maps to a unique integer in the range [0, K^N).
+//
+//==============================================================================
+static inline StateRank RankState(StateCode state, int numDisks, int numPegs)
+{
+    StateRank rank = 0;
+    for (int i = numDisks-1; i >= 0; i--)
+    {
+        rank = rank*numPegs + StateCodec::GetPeg(state, i);
+    }
+    return rank;
+}
+
+//==============================================================================
+//
+// Class declaration for the target set
+//
+// The end states of a multi-target query. Membership is tested for every
+// state a search discovers, so when the whole space is small enough for the
+// dense vertex index the targets are kept as a bitmap by rank; larger spaces
+// use a hash set of codes. The bitmap is kept between queries and only the
+// bits of the previous targets are cleared.
+//
+//==============================================================================
+class TargetSet
+{
+public:
+    TargetSet() : useBitmap(false), numTargets(0) { }
+
+    void Build(int numDisks, int numPegs, const std::vector<StateCode>& states);
+
+    bool Contains(StateCode state, StateRank rank) const
+    {
+        if (useBitmap)
+        {
+            return (bitmap[rank / 64] >> (rank % 64)) & 1;
+        }
+        return hashSet.find(state) != hashSet.end();
+    }
+
+    // number of distinct targets
+    size_t Size(void) const { return numTargets; }
+
+private:
+    bool useBitmap;
+    size_t numTargets;
+    std::vector<uint64_t> bitmap;
+    std::vector<StateRank> bitmapRanks;
+    std::unordered_set<StateCode> hashSet;
+};
+
+//==============================================================================
+//
+// Target Set Build
+//
+//==============================================================================
+void TargetSet::Build(int numDisks, int numPegs, const std::vector<StateCode>& states)
+{
+    for (size_t i = 0; i < bitmapRanks.size(); i++)
+    {
+        bitmap[bitmapRanks[i] / 64] = 0;
+    }
+    bitmapRanks.clear();
+    hashSet.clear();
+
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks && numStates <= MAX_DENSE_INDEX_STATES; i++)
+    {
+        numStates *= numPegs;
+    }
+    useBitmap = numStates <= MAX_DENSE_INDEX_STATES;
+    numTargets = 0;
 
-#include <cstring> // for memset
-#include <cstdlib> // for atoi
-#include <cstdio>  // for getchar
+    if (!useBitmap)
+    {
+        hashSet.insert(states.begin(), states.end());
+        numTargets = hashSet.size();
+        return;
+    }
 
-#define MAX_NUMBER_BUF 128
+    if (bitmap.size() < (numStates + 63) / 64)
+    {
+        bitmap.resize((numStates + 63) / 64, 0);
+    }
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        StateRank rank = RankState(states[i], numDisks, numPegs);
+        uint64_t bit = 1ull << (rank % 64);
+        if (!(bitmap[rank / 64] & bit))
+        {
+            bitmap[rank / 64] |= bit;
+            bitmapRanks.push_back(rank);
+            numTargets++;
+        }
+    }
+}
 
 //==============================================================================
 // 
@@ -23,320 +234,4604 @@ public:
         kVertexColor_Black,
     } VertexColor;
 
-    typedef struct Edge
+    // which search frontier discovered a vertex
+    typedef enum
     {
-        struct Edge *next;
-        int vertexIndex;
-    } Edge;
+        kSearchSide_None,
+        kSearchSide_Forward,
+        kSearchSide_Backward,
+    } SearchSide;
 
-    typedef struct Vertex
+    // index used where there is no vertex (e.g. the start's predecessor)
+    enum { kNoVertex = -1 };
+
+    Graph(int numDisks, int numPegs);
+
+    void Configure(int numDisks, int numPegs);
+    StateRank RankState(StateCode state) { return ::RankState(state, numDisks, numPegs); }
+    int FindVertex(StateCode state);
+    int GetVertex(StateCode state) { return GetVertex(state, RankState(state)); }
+    int GetVertex(StateCode state, StateRank rank);
+    int BuildAndExplore(StateCode startState, StateCode endState)
     {
-        VertexColor color;
-        int index;
-        int distance;
-        Edge *edgeList;
-        std::vector<int> state;
-        struct Vertex *predecessor;
-        int lastMove[2];
-    } Vertex;
+        return (this->*exploreKernel)(startState, endState);
+    }
+    int BuildAndExploreBidirectional(StateCode startState, StateCode endState);
+    int ExploreTargets(StateCode startState, const TargetSet& targets, bool findAll);
+    void GetSolution(std::vector<Move>& moves);
+    void ExportAdjacency(std::vector<int>& offsets, std::vector<int>& targets);
+    void Reset(void);
+    StateCode Canonicalize(StateCode state);
 
-    Graph(int numDisks, int numPegs) : numDisks(numDisks), numPegs(numPegs), numVertices(0) { }
+    // when set, searches merge states that differ only by a relabeling of
+    // the pegs that are empty in endState (see PrepareSymmetry)
+    bool useSymmetry;
 
-    ~Graph() { Cleanup(); }
+    // when set, every BFS level is sorted by state before it is expanded.
+    // Sorting by code is sorting by rank, so the dense index is then walked
+    // in increasing order instead of at random.
+    bool sortFrontier;
 
-    Vertex *GetVertex(std::vector<int>& state);
-    int BuildAndExplore(std::vector<int>& startState, std::vector<int>& endState);
-    void Cleanup(void);
+    // searches give up on solutions longer than this many moves (-1 for no
+    // limit), returning -1 as if there were none
+    int maxDistance;
+
+    // counters of the last search (verticesCreated is numVertices)
+    SearchStats stats;
+
+    // bumped by every Reset, so a caller can tell whether a query used the graph
+    unsigned numResets;
 
     int numDisks;
     int numPegs;
     int numVertices;
-    std::list<Vertex> vtxList;
+
+    // Vertex pool. Vertices are referred to by index and their fields live in
+    // parallel arrays; the arrays only ever grow, so Reset just rewinds
+    // numVertices and successive searches reuse the same memory.
+    std::vector<StateCode> vtxState;
+    std::vector<uint8_t> vtxColor;
+    std::vector<uint8_t> vtxSide;
+    std::vector<int> vtxDistance;
+    std::vector<int> vtxPredecessor;
+    std::vector<Move> vtxLastMove;
+
+    // state rank -> vertex index lookup. When K^N is small enough every
+    // possible state gets a slot in denseIndex, otherwise sparseIndex is used.
+    // Entries are never cleared: one is only trusted if it names a vertex
+    // created since the last Reset that actually holds the state.
+    bool useDenseIndex;
+    std::vector<int> denseIndex;
+    std::unordered_map<StateRank, int> sparseIndex;
+
+    // where the last search connected start to end: the forward chain ends at
+    // meetForward, and for bidirectional searches meetMove leads from there to
+    // meetBackward, the head of the backward chain.
+    int meetForward;
+    int meetBackward;
+    Move meetMove;
+
+private:
+    // BFS levels as vertex indices: the level being expanded and the one
+    // being discovered (a bidirectional search keeps one level per side).
+    // Their memory is kept from search to search.
+    std::vector<int> frontier;
+    std::vector<int> backwardFrontier;
+    std::vector<int> nextFrontier;
+    void SortFrontier(std::vector<int>& levelVertices);
+
+    // the searches expand their levels EXPAND_BATCH_STATES vertices at a time
+    // through ExpandStates: GatherBatch copies the states of the batch
+    // starting at levelVertices[first] and returns its size, BlackenBatch
+    // marks the batch expanded
+    int GatherBatch(const std::vector<int>& levelVertices, size_t first, StateCode *states)
+    {
+        int numStates = std::min((size_t)EXPAND_BATCH_STATES, levelVertices.size() - first);
+        for (int i = 0; i < numStates; i++)
+        {
+            states[i] = vtxState[levelVertices[first + i]];
+        }
+        return numStates;
+    }
+    void BlackenBatch(const std::vector<int>& levelVertices, size_t first, int numStates)
+    {
+        for (int i = 0; i < numStates; i++)
+        {
+            vtxColor[levelVertices[first + i]] = kVertexColor_Black;
+        }
+    }
+
+    // BuildAndExplore compiled for one puzzle size, so the disk and peg loops
+    // of state ranking have constant bounds and unroll.
+    // Explore<0, 0> takes the size from numDisks and numPegs instead.
+    typedef int (Graph::*ExploreKernel)(StateCode startState, StateCode endState);
+    template <int N, int K> int Explore(StateCode startState, StateCode endState);
+    static const ExploreKernel exploreKernels[MAX_FIXED_DISKS+1][MAX_FIXED_PEGS+1];
+    ExploreKernel exploreKernel;
+
+    void PrepareSymmetry(StateCode startState, StateCode endState);
+    void ReplaySolution(std::vector<Move>& moves);
+
+    bool IsVertex(int vtx, StateCode state)
+    {
+        return vtx >= 0 && vtx < numVertices && vtxState[vtx] == state;
+    }
+    int AddVertex(StateCode state);
+
+    // the interchangeable pegs of the current search, in increasing order,
+    // and the real (not canonical) start state needed to replay its moves
+    int numSymmetricPegs;
+    int symmetricPegs[StateCodec::kMaxPegs];
+    StateCode realStartState;
 };
 
 //==============================================================================
 //
-// Graph Cleanup
+// Graph Constructor
+//
+// figure out how large the state space is and pick a vertex lookup scheme
+//
+//==============================================================================
+Graph::Graph(int numDisks, int numPegs) :
+    useSymmetry(false), sortFrontier(false), maxDistance(-1), stats(), numResets(0), numDisks(0), numPegs(0), numVertices(0), useDenseIndex(false),
+    meetForward(kNoVertex), meetBackward(kNoVertex), exploreKernel(&Graph::Explore<0, 0>),
+    numSymmetricPegs(0), realStartState(0)
+{
+    Configure(numDisks, numPegs);
+}
+
+//==============================================================================
+//
+// Graph Configure
 //
-// destroy any objects created/allocated during graph building
+// Switch the graph to a (possibly) different puzzle size. The vertex pool is
+// kept, so a single graph can serve many puzzles; the lookup tables are only
+// rebuilt when the size actually changes.
 //
 //==============================================================================
-void Graph::Cleanup(void)
+void Graph::Configure(int numDisks, int numPegs)
 {
-    std::list<Vertex>::iterator iter;
-    for (iter = vtxList.begin(); iter != vtxList.end(); iter++)
+    Reset();
+    if (numDisks == this->numDisks && numPegs == this->numPegs)
     {
-        Edge *cur = (*iter).edgeList;
-        while (cur)
-        {
-            Edge *next = cur->next;
-            delete cur;
-            cur = next;
-        }
+        return;
+    }
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+
+    exploreKernel = &Graph::Explore<0, 0>;
+    if (numDisks <= MAX_FIXED_DISKS && numPegs >= MIN_FIXED_PEGS && numPegs <= MAX_FIXED_PEGS)
+    {
+        exploreKernel = exploreKernels[numDisks][numPegs];
+    }
+
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks && numStates <= MAX_DENSE_INDEX_STATES; i++)
+    {
+        numStates *= numPegs;
+    }
+
+    useDenseIndex = (numStates <= MAX_DENSE_INDEX_STATES);
+    if (useDenseIndex)
+    {
+        denseIndex.assign(numStates, (int)kNoVertex);
     }
-    vtxList.clear();
+    else
+    {
+        denseIndex.clear();
+    }
+    sparseIndex.clear();
+}
+
+//==============================================================================
+//
+// Graph Reset
+//
+// Forget every vertex from the previous search. This is O(1): the vertex pool
+// and lookup tables keep their memory and stale entries are simply ignored.
+//
+//==============================================================================
+void Graph::Reset(void)
+{
     numVertices = 0;
+    stats = SearchStats();
+    numResets++;
+    meetForward = kNoVertex;
+    meetBackward = kNoVertex;
 }
 
 //==============================================================================
 //
-// Get Vertex
+// Add Vertex
+//
+// take the next vertex out of the pool, growing the pool if it is exhausted
+//
+//==============================================================================
+int Graph::AddVertex(StateCode state)
+{
+    if (numVertices == (int)vtxState.size())
+    {
+        vtxState.push_back(0);
+        vtxColor.push_back(0);
+        vtxSide.push_back(0);
+        vtxDistance.push_back(0);
+        vtxPredecessor.push_back(0);
+        vtxLastMove.push_back(Move());
+    }
+
+    int vtx = numVertices++;
+    vtxState[vtx] = state;
+    vtxColor[vtx] = kVertexColor_White;
+    vtxSide[vtx] = kSearchSide_None;
+    vtxDistance[vtx] = 0;
+    vtxPredecessor[vtx] = kNoVertex;
+    return vtx;
+}
+
+//==============================================================================
+//
+// Find Vertex
 //
-// look up a vertex object given its "state"
+// look up an existing vertex given its "state", without creating one
 //
 //==============================================================================
-Graph::Vertex *Graph::GetVertex(std::vector<int>& state)
+int Graph::FindVertex(StateCode state)
 {
-    // TODO: ideally this should be implemented with hashing to be more
-    // efficient, but this is just to get it done:
-    std::list<Vertex>::iterator iter;
-    for (iter = vtxList.begin(); iter != vtxList.end(); iter++)
+    StateRank rank = RankState(state);
+    int vtx = kNoVertex;
+    if (useDenseIndex)
+    {
+        vtx = denseIndex[rank];
+    }
+    else
     {
-        Vertex *vtx = &(*iter);
-        if (std::equal(vtx->state.begin(), vtx->state.end(), state.begin()))
+        std::unordered_map<StateRank, int>::iterator iter = sparseIndex.find(rank);
+        if (iter != sparseIndex.end())
         {
-            return vtx;
+            vtx = iter->second;
         }
     }
+    return IsVertex(vtx, state) ? vtx : kNoVertex;
+}
 
-    // if we made it here, this vertex doesn't exist. Create it.
-    Vertex newVtx;
-    memset(&newVtx, 0, sizeof(Vertex));
+//==============================================================================
+//
+// Get Vertex
+//
+// look up a vertex given its "state" and that state's rank, creating it if
+// necessary
+//
+//==============================================================================
+inline int Graph::GetVertex(StateCode state, StateRank rank)
+{
+    int *slot;
+    if (useDenseIndex)
+    {
+        slot = &denseIndex[rank];
+    }
+    else
+    {
+        slot = &sparseIndex.insert(std::make_pair(rank, (int)kNoVertex)).first->second;
+    }
 
-    newVtx.color = kVertexColor_White;
-    newVtx.state = state;
-    newVtx.index = numVertices++;
-    vtxList.push_back(newVtx);
+    if (!IsVertex(*slot, state))
+    {
+        // if we made it here, this vertex doesn't exist. Create it.
+        *slot = AddVertex(state);
+    }
+    return *slot;
+}
 
-    return &vtxList.back();
+//==============================================================================
+//
+// Compute Peg Masks
+//
+// Decode a packed state into one bit mask per peg, where bit d is set if disk
+// d sits on that peg. The top (smallest) disk of a peg is then simply the
+// lowest set bit of its mask.
+//
+//==============================================================================
+static inline void ComputePegMasks(StateCode state, int numDisks, int numPegs, uint32_t *pegMasks)
+{
+    for (int peg = 0; peg < numPegs; peg++)
+    {
+        pegMasks[peg] = 0;
+    }
+    for (int disk = 0; disk < numDisks; disk++)
+    {
+        pegMasks[StateCodec::GetPeg(state, disk)] |= 1u << disk;
+    }
 }
 
 //==============================================================================
 //
-// Peg Has Smaller Disk
+// Generate Moves
+//
+// Enumerate every legal move out of a state. The peg masks are computed once,
+// after which each (from, to) peg pair is checked in constant time: the move
+// is legal if "from" is not empty and "to" is either empty or topped by a
+// larger disk. Because each top disk is an isolated power of two, comparing
+// the isolated low bits compares the disk sizes directly.
 //
-// Utility function for looking seeing if a particular peg has a smaller disk
-// on it, given a "state" array. This is used while trying to figure out what
-// valid neighbor states exist for a given state.
+// Fills in the successor state and the move leading to it, returning the
+// number of moves generated (at most MAX_MOVES_PER_STATE).
 //
 //==============================================================================
-static bool PegHasSmallerDisk(std::vector<int>& state, int diskRad, int peg)
+static inline int GenerateMoves(StateCode state, int numDisks, int numPegs,
+        StateCode *newStates, Move *moves)
 {
-    for (int i = diskRad-1; i >= 0; i--)
+    uint32_t pegMasks[StateCodec::kMaxPegs];
+    ComputePegMasks(state, numDisks, numPegs, pegMasks);
+
+    int numMoves = 0;
+    for (int fromPeg = 0; fromPeg < numPegs; fromPeg++)
     {
-        if (state[i] == peg)
+        uint32_t fromTop = pegMasks[fromPeg] & (0u - pegMasks[fromPeg]);
+        if (!fromTop)
+        {
+            continue;
+        }
+        int disk = __builtin_ctz(fromTop);
+
+        for (int toPeg = 0; toPeg < numPegs; toPeg++)
         {
-            return true;
+            uint32_t toTop = pegMasks[toPeg] & (0u - pegMasks[toPeg]);
+            if (toPeg == fromPeg || (toTop && toTop < fromTop))
+            {
+                continue;
+            }
+
+            newStates[numMoves] = StateCodec::SetPeg(state, disk, toPeg);
+            moves[numMoves].fromPeg = fromPeg;
+            moves[numMoves].toPeg = toPeg;
+            numMoves++;
         }
     }
-    return false;
+    return numMoves;
 }
 
 //==============================================================================
 //
-// Disk Not Smallest On Peg
+// Undo Move
 //
-// Utility function for looking seeing if a particular disk is or is not the
-// smallest on a peg, given a "state" array. This is used while trying to
-// figure out what valid neighbor states exist for a given state.
+// Given the state reached by a move, recover the state before it: the disk
+// that moved is now the top (smallest) disk on the move's destination peg.
 //
 //==============================================================================
-static bool DiskNotSmallestOnPeg(std::vector<int>& state, int diskRad)
+static StateCode UndoMove(StateCode state, int numDisks, const Move& move)
 {
-    for (int i = diskRad-1; i >= 0; i--)
+    for (int disk = 0; disk < numDisks; disk++)
     {
-        if (state[i] == state[diskRad])
+        if (StateCodec::GetPeg(state, disk) == move.toPeg)
         {
-            return true;
+            return StateCodec::SetPeg(state, disk, move.fromPeg);
         }
     }
-    return false;
+    return state;
 }
 
 //==============================================================================
 //
-// Build And Explore
+// Expand States
 //
-// This is a standard "Breadth First Search" algorithm for an undirected graph,
-// but where the neighbor vertices and adjacent edges are actually calculated
-// on the fly using a couple of utility functions to determine what valid
-// neighbor states exist.
+// Generate the successors of a batch of up to EXPAND_BATCH_STATES states in
+// one call: all moves go to newStates and moves, in the order GenerateMoves
+// would produce them state by state, and parents gets the batch index of the
+// state each one came from. Returns the number of successors.
+//
+// ExpandStates points at the fastest version the CPU supports. The AVX2
+// version works on eight 32-bit states per instruction: it builds the peg
+// masks of all eight at once, then tests every (from, to) peg pair across
+// the lanes. Moving a top disk d by (to - from) pegs adds (to - from) << 3d
+// to the code, and with the disk isolated as the bit 1 << d, (1 << d) cubed
+// is exactly 1 << 3d, so each successor is a multiply-add.
 //
 //==============================================================================
-int Graph::BuildAndExplore(std::vector<int>& startState, std::vector<int>& endState)
-{
-    // make this the first vertex:
-    Cleanup();
+typedef int (*ExpandStatesFunction)(const StateCode *states, int numStates, int numDisks,
+        int numPegs, StateCode *newStates, Move *moves, int *parents);
 
-    // for each disk d in the state
-    //    if the disk is not the smallest on its peg, continue
-    //    for each peg p not equal to the peg the d is on
-    //        if (p not occupied by smaller disk)
-    //            move disk d to peg p (creating new state and vertex)
-    //            make an edge to the new state
-    Vertex *startVtx = GetVertex(startState);
-    startVtx->color = kVertexColor_Grey;
+static int ExpandStatesScalar(const StateCode *states, int numStates, int numDisks,
+        int numPegs, StateCode *newStates, Move *moves, int *parents)
+{
+    int numNew = 0;
+    for (int i = 0; i < numStates; i++)
+    {
+        int numMoves = GenerateMoves(states[i], numDisks, numPegs, newStates+numNew, moves+numNew);
+        for (int j = 0; j < numMoves; j++)
+        {
+            parents[numNew+j] = i;
+        }
+        numNew += numMoves;
+    }
+    return numNew;
+}
 
-    // populate the list with the first node
-    std::list<Vertex *> bfsList;
-    bfsList.push_back(startVtx);
+#ifdef FBHANOI_AVX2_KERNEL
+__attribute__((target("avx2")))
+static int ExpandStatesAvx2(const StateCode *states, int numStates, int numDisks,
+        int numPegs, StateCode *newStates, Move *moves, int *parents)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i pegMask = _mm256_set1_epi32(StateCodec::kPegMask);
 
-    while (!bfsList.empty())
+    int numNew = 0;
+    for (int first = 0; first < numStates; first += 8)
     {
-        Vertex *curVtx = bfsList.front();
-        bfsList.pop_front();
+        int numLanes = std::min(8, numStates - first);
+        uint32_t codes[8];
+        for (int lane = 0; lane < 8; lane++)
+        {
+            codes[lane] = states[first + std::min(lane, numLanes-1)];
+        }
+        __m256i code = _mm256_loadu_si256((const __m256i *)codes);
 
-        // calculate all neighbors for this vertex
-        std::vector<int> curState = curVtx->state;
-        for (int diskRad = 0; diskRad < curState.size(); diskRad++)
+        __m256i tops[StateCodec::kMaxPegs];
+        for (int peg = 0; peg < numPegs; peg++)
         {
-            // in order for this disk to be moveable, it must be the smallest
-            // on its peg
-            if (DiskNotSmallestOnPeg(curState, diskRad))
+            tops[peg] = zero;
+        }
+        for (int disk = 0; disk < numDisks; disk++)
+        {
+            __m256i peg = _mm256_and_si256(
+                    _mm256_srl_epi32(code, _mm_cvtsi32_si128(StateCodec::kBitsPerDisk * disk)), pegMask);
+            __m256i bit = _mm256_set1_epi32(1 << disk);
+            for (int p = 0; p < numPegs; p++)
             {
-                continue;
+                __m256i onPeg = _mm256_cmpeq_epi32(peg, _mm256_set1_epi32(p));
+                tops[p] = _mm256_or_si256(tops[p], _mm256_and_si256(onPeg, bit));
             }
-            for (int peg = 0; peg < numPegs; peg++)
+        }
+        for (int peg = 0; peg < numPegs; peg++)
+        {
+            tops[peg] = _mm256_and_si256(tops[peg], _mm256_sub_epi32(zero, tops[peg]));
+        }
+
+        // legal lanes and successor codes for every (from, to) pair
+        uint32_t successors[MAX_MOVES_PER_STATE][8];
+        Move pairMoves[MAX_MOVES_PER_STATE];
+        uint64_t legalPairs[8] = { 0 };
+        int numPairs = 0;
+        for (int fromPeg = 0; fromPeg < numPegs; fromPeg++)
+        {
+            __m256i fromTop = tops[fromPeg];
+            __m256i occupied = _mm256_xor_si256(_mm256_cmpeq_epi32(fromTop, zero),
+                    _mm256_set1_epi32(-1));
+            __m256i step = _mm256_mullo_epi32(_mm256_mullo_epi32(fromTop, fromTop), fromTop);
+            for (int toPeg = 0; toPeg < numPegs; toPeg++)
             {
-                if (peg == curState[diskRad] ||
-                        PegHasSmallerDisk(curState, diskRad, peg))
+                if (toPeg == fromPeg)
                 {
                     continue;
                 }
-            
-                std::vector<int> newState = curState;
-                newState[diskRad] = peg;
+                __m256i toTop = tops[toPeg];
+                __m256i legal = _mm256_and_si256(occupied, _mm256_or_si256(
+                        _mm256_cmpeq_epi32(toTop, zero), _mm256_cmpgt_epi32(toTop, fromTop)));
+                __m256i successor = _mm256_add_epi32(code,
+                        _mm256_mullo_epi32(step, _mm256_set1_epi32(toPeg - fromPeg)));
+                _mm256_storeu_si256((__m256i *)successors[numPairs], successor);
+                pairMoves[numPairs].fromPeg = fromPeg;
+                pairMoves[numPairs].toPeg = toPeg;
 
-                Vertex *newVtx = GetVertex(newState);
-                if (newVtx)
+                // transpose the lane mask into per-lane sets of legal pairs
+                int legalLanes = _mm256_movemask_ps(_mm256_castsi256_ps(legal));
+                for (int lanes = legalLanes; lanes; lanes &= lanes-1)
                 {
-                    // add edges pointing between them
-                    Edge *edge1 = new Edge;
-                    edge1->vertexIndex = newVtx->index;
-                    edge1->next = curVtx->edgeList;
-                    curVtx->edgeList = edge1;
-
-                    Edge *edge2 = new Edge;
-                    edge2->vertexIndex = curVtx->index;
-                    edge2->next = newVtx->edgeList;
-                    newVtx->edgeList = edge2;
-
-                    if (newVtx->color == kVertexColor_White)
-                    {
-                        newVtx->predecessor = curVtx;
-                        newVtx->distance = curVtx->distance+1;
-                        newVtx->color = kVertexColor_Grey;
-                        newVtx->lastMove[0] = curState[diskRad]+1;
-                        newVtx->lastMove[1] = peg+1;
-                        bfsList.push_back(newVtx);
-                    }
+                    legalPairs[__builtin_ctz(lanes)] |= 1ull << numPairs;
                 }
+                numPairs++;
             }
         }
 
-        curVtx->color = kVertexColor_Black;
-        if (std::equal(curVtx->state.begin(), curVtx->state.end(), endState.begin()))
+        for (int lane = 0; lane < numLanes; lane++)
         {
-            return curVtx->distance;
+            for (uint64_t pairs = legalPairs[lane]; pairs; pairs &= pairs-1)
+            {
+                int pair = __builtin_ctzll(pairs);
+                newStates[numNew] = successors[pair][lane];
+                moves[numNew] = pairMoves[pair];
+                parents[numNew] = first + lane;
+                numNew++;
+            }
         }
     }
+    return numNew;
+}
+#endif
+
+static ExpandStatesFunction SelectExpandStates(void)
+{
+#ifdef FBHANOI_AVX2_KERNEL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return ExpandStatesAvx2;
+    }
+#endif
+    return ExpandStatesScalar;
 }
 
+static const ExpandStatesFunction ExpandStates = SelectExpandStates();
 
 //==============================================================================
 //
-// Get Next Integer
+// Prepare Symmetry
 //
-// Read a whitespace delimited string from STDIN and convert it to an integer.
+// Pegs that are empty in endState are interchangeable: swapping any two of
+// them maps the puzzle onto itself, so states that differ only in how those
+// pegs are labeled are equally far from the goal. With useSymmetry set, the
+// search works on one canonical representative per such class, which for
+// K=5 and a goal on one peg shrinks the state space by up to 4! = 24x.
 //
 //==============================================================================
-int GetNextInt(void)
+void Graph::PrepareSymmetry(StateCode startState, StateCode endState)
 {
-    char buf[MAX_NUMBER_BUF];
-    int bufIndex = 0;
+    realStartState = startState;
+    numSymmetricPegs = 0;
+    if (!useSymmetry)
+    {
+        return;
+    }
 
-    do
+    uint32_t occupied = 0;
+    for (int disk = 0; disk < numDisks; disk++)
+    {
+        occupied |= 1u << StateCodec::GetPeg(endState, disk);
+    }
+    for (int peg = 0; peg < numPegs; peg++)
     {
-        buf[bufIndex++] = getchar();
-    } while (buf[bufIndex-1] != ' ' && buf[bufIndex-1] != '\n');
-    buf[bufIndex-1] = 0;
+        if (!(occupied & (1u << peg)))
+        {
+            symmetricPegs[numSymmetricPegs++] = peg;
+        }
+    }
 
-    return atoi(buf);
+    // a single free peg has nothing to be swapped with
+    if (numSymmetricPegs < 2)
+    {
+        numSymmetricPegs = 0;
+    }
 }
 
 //==============================================================================
 //
-// Print State
+// Canonicalize
 //
-// Print a formatted configuration of the pegs
+// Relabel the interchangeable pegs in order of first use, scanning from the
+// largest disk down: the interchangeable peg holding the largest disk becomes
+// the lowest numbered one, and so on. Every state in a symmetry class maps to
+// the same representative, and endState (where they are all empty) maps to
+// itself.
 //
 //==============================================================================
-void PrintState(std::vector<int>& state)
+StateCode Graph::Canonicalize(StateCode state)
 {
-    std::cout << "state = " << std::endl << "    ";
-    for (int i = 0; i < state.size()-1; i++)
+    if (numSymmetricPegs == 0)
     {
-        std::cout << state[i]+1 << ' ';
+        return state;
+    }
+
+    int relabel[StateCodec::kMaxPegs];
+    bool symmetric[StateCodec::kMaxPegs];
+    for (int peg = 0; peg < numPegs; peg++)
+    {
+        relabel[peg] = peg;
+        symmetric[peg] = false;
+    }
+    for (int i = 0; i < numSymmetricPegs; i++)
+    {
+        symmetric[symmetricPegs[i]] = true;
     }
-    std::cout << state[state.size()-1]+1 << std::endl;
-}
 
+    int numAssigned = 0;
+    for (int disk = numDisks-1; disk >= 0 && numAssigned < numSymmetricPegs; disk--)
+    {
+        int peg = StateCodec::GetPeg(state, disk);
+        if (symmetric[peg])
+        {
+            relabel[peg] = symmetricPegs[numAssigned++];
+            symmetric[peg] = false;
+        }
+    }
+
+    StateCode canonical = 0;
+    for (int disk = 0; disk < numDisks; disk++)
+    {
+        canonical = StateCodec::SetPeg(canonical, disk, relabel[StateCodec::GetPeg(state, disk)]);
+    }
+    return canonical;
+}
 
 //==============================================================================
 //
-// Print Move
+// Build And Explore
 //
-// print a formatted "move" as it exists in the vertex data
+// This is a standard "Breadth First Search" algorithm for an undirected graph,
+// but where the graph is implicit: the neighbors of a vertex are calculated
+// on the fly, a batch of the level's vertices at a time by ExpandStates, and
+// no edges are ever stored.
 //
-//==============================================================================
-void PrintMove(Graph::Vertex *vtx)
-{
-    std::cout << vtx->lastMove[0] << " " << vtx->lastMove[1] << std::endl;
-}
-
-//==============================================================================
+// The goal test is made as each state is discovered, so the search ends
+// without expanding the rest of the final level, and a level is only
+// expanded if its successors are within maxDistance.
 //
-// main
+// N and K are the puzzle size when known at compile time, or 0 to use the
+// size the graph is configured for.
 //
 //==============================================================================
-int main(int argc, char **argv)
+template <int N, int K>
+int Graph::Explore(StateCode startState, StateCode endState)
 {
-    int numDisks = GetNextInt();
-    int numPegs = GetNextInt();
-    std::vector<int> startState;
-    std::vector<int> endState;
+    const int numDisks = N ? N : this->numDisks;
+    const int numPegs = K ? K : this->numPegs;
 
-    for (int i = 0; i < numDisks; i++)
-    {
-        startState.push_back(GetNextInt()-1);
-    }
+    // make this the first vertex:
+    Reset();
+    PrepareSymmetry(startState, endState);
 
-    for (int i = 0; i < numDisks; i++)
+    // for each legal move out of the current state
+    //    apply the move (creating new state and vertex)
+    int startVtx = GetVertex(Canonicalize(startState));
+    vtxColor[startVtx] = kVertexColor_Grey;
+    vtxSide[startVtx] = kSearchSide_Forward;
+    if (vtxState[startVtx] == endState)
     {
-        endState.push_back(GetNextInt()-1);
+        meetForward = startVtx;
+        return 0;
     }
 
-    Graph *graph = new Graph(numDisks, numPegs);
-
-    int numMoves = graph->BuildAndExplore(startState, endState);
-    std::cout << "num moves = " << numMoves << std::endl;
-
-    Graph::Vertex *vtx = graph->GetVertex(endState);
-    std::list<Graph::Vertex *> forwardList;
-    for (int i = 0; i < numMoves; i++)
-    {
-        forwardList.push_front(vtx);
-        vtx = vtx->predecessor;
-    }
+    // the first level is just the start vertex
+    frontier.assign(1, startVtx);
 
-    std::cout << numMoves << std::endl;
-    std::list<Graph::Vertex *>::iterator iter;
-    for (iter = forwardList.begin(); iter != forwardList.end(); iter++)
+    StateCode batchStates[EXPAND_BATCH_STATES];
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move moves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    while (!frontier.empty())
     {
-        PrintMove(*iter); 
-    }
-
-    delete graph;
+        if (maxDistance >= 0 && vtxDistance[frontier[0]] >= maxDistance)
+        {
+            return -1;
+        }
 
-    return 0;
+        PEAK_STAT(stats.frontierPeak, frontier.size());
+        nextFrontier.clear();
+        for (size_t first = 0; first < frontier.size(); first += EXPAND_BATCH_STATES)
+        {
+            // calculate all neighbors for a batch of the level's vertices
+            int numCurrent = GatherBatch(frontier, first, batchStates);
+            int numMoves = ExpandStates(batchStates, numCurrent, numDisks, numPegs,
+                    newStates, moves, parents);
+            COUNT_STAT(stats.statesExpanded, numCurrent);
+            COUNT_STAT(stats.edgesGenerated, numMoves);
+            for (int i = 0; i < numMoves; i++)
+            {
+                int curVtx = frontier[first + parents[i]];
+                StateCode newState = Canonicalize(newStates[i]);
+                int newVtx = GetVertex(newState, ::RankState(newState, numDisks, numPegs));
+                if (vtxColor[newVtx] == kVertexColor_White)
+                {
+                    vtxPredecessor[newVtx] = curVtx;
+                    vtxDistance[newVtx] = vtxDistance[curVtx]+1;
+                    vtxColor[newVtx] = kVertexColor_Grey;
+                    vtxSide[newVtx] = kSearchSide_Forward;
+                    vtxLastMove[newVtx] = moves[i];
+                    if (newState == endState)
+                    {
+                        meetForward = newVtx;
+                        return vtxDistance[newVtx];
+                    }
+                    nextFrontier.push_back(newVtx);
+                }
+                else
+                {
+                    COUNT_STAT(stats.duplicateHits, 1);
+                }
+            }
+            BlackenBatch(frontier, first, numCurrent);
+        }
+
+        if (sortFrontier)
+        {
+            SortFrontier(nextFrontier);
+        }
+        frontier.swap(nextFrontier);
+    }
+    return -1;
+}
+
+//==============================================================================
+//
+// Sort Frontier
+//
+// order a BFS level by state, which is also the order of the states' ranks
+//
+//==============================================================================
+void Graph::SortFrontier(std::vector<int>& levelVertices)
+{
+    const std::vector<StateCode>& states = vtxState;
+    std::sort(levelVertices.begin(), levelVertices.end(),
+            [&states](int a, int b) { return states[a] < states[b]; });
+}
+
+//==============================================================================
+//
+// Explore Kernels
+//
+// One specialization of Explore per puzzle size from 1 to MAX_FIXED_DISKS
+// disks and MIN_FIXED_PEGS to MAX_FIXED_PEGS pegs; unused slots stay NULL.
+//
+//==============================================================================
+#define EXPLORE_KERNELS(n) { NULL, NULL, NULL, \
+    &Graph::Explore<n, 3>, &Graph::Explore<n, 4>, &Graph::Explore<n, 5> }
+
+const Graph::ExploreKernel Graph::exploreKernels[MAX_FIXED_DISKS+1][MAX_FIXED_PEGS+1] =
+{
+    { NULL, NULL, NULL, NULL, NULL, NULL },
+    EXPLORE_KERNELS(1), EXPLORE_KERNELS(2), EXPLORE_KERNELS(3), EXPLORE_KERNELS(4),
+    EXPLORE_KERNELS(5), EXPLORE_KERNELS(6), EXPLORE_KERNELS(7), EXPLORE_KERNELS(8)
+};
+
+#undef EXPLORE_KERNELS
+
+//==============================================================================
+//
+// Build And Explore Bidirectional
+//
+// Breadth first search grown from both ends at once. Each round expands one
+// complete BFS level of whichever frontier is currently smaller. Whenever a
+// generated neighbor already belongs to the opposite search, the two trees
+// touch; the shortest such connection seen over the finished level is an
+// optimal path, so the search stops after that level. Vertices found by the
+// backward search keep their distance to endState, and their predecessor
+// points one step closer to it.
+//
+//==============================================================================
+int Graph::BuildAndExploreBidirectional(StateCode startState, StateCode endState)
+{
+    Reset();
+    PrepareSymmetry(startState, endState);
+
+    int startVtx = GetVertex(Canonicalize(startState));
+    vtxColor[startVtx] = kVertexColor_Grey;
+    vtxSide[startVtx] = kSearchSide_Forward;
+    if (vtxState[startVtx] == endState)
+    {
+        meetForward = startVtx;
+        return 0;
+    }
+
+    int endVtx = GetVertex(endState);
+    vtxColor[endVtx] = kVertexColor_Grey;
+    vtxSide[endVtx] = kSearchSide_Backward;
+
+    frontier.assign(1, startVtx);
+    backwardFrontier.assign(1, endVtx);
+
+    StateCode batchStates[EXPAND_BATCH_STATES];
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move moves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int bestDistance = -1;
+    while (!frontier.empty() && !backwardFrontier.empty())
+    {
+        // anything found next is at least one move longer than both levels
+        int minDistance = vtxDistance[frontier[0]] + vtxDistance[backwardFrontier[0]] + 1;
+        if (maxDistance >= 0 && minDistance > maxDistance)
+        {
+            return -1;
+        }
+
+        bool expandForward = frontier.size() <= backwardFrontier.size();
+        std::vector<int>& levelVertices = expandForward ? frontier : backwardFrontier;
+        SearchSide side = expandForward ? kSearchSide_Forward : kSearchSide_Backward;
+
+        // expand exactly the vertices of the current level
+        PEAK_STAT(stats.frontierPeak, levelVertices.size());
+        nextFrontier.clear();
+        for (size_t first = 0; first < levelVertices.size(); first += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = GatherBatch(levelVertices, first, batchStates);
+            int numMoves = ExpandStates(batchStates, numCurrent, numDisks, numPegs,
+                    newStates, moves, parents);
+            COUNT_STAT(stats.statesExpanded, numCurrent);
+            COUNT_STAT(stats.edgesGenerated, numMoves);
+            for (int i = 0; i < numMoves; i++)
+            {
+                int curVtx = levelVertices[first + parents[i]];
+                int newVtx = GetVertex(Canonicalize(newStates[i]));
+                if (vtxColor[newVtx] == kVertexColor_White)
+                {
+                    vtxPredecessor[newVtx] = curVtx;
+                    vtxDistance[newVtx] = vtxDistance[curVtx]+1;
+                    vtxColor[newVtx] = kVertexColor_Grey;
+                    vtxSide[newVtx] = side;
+                    vtxLastMove[newVtx] = moves[i];
+                    nextFrontier.push_back(newVtx);
+                    continue;
+                }
+
+                COUNT_STAT(stats.duplicateHits, 1);
+                if (vtxSide[newVtx] != side)
+                {
+                    int distance = vtxDistance[curVtx] + 1 + vtxDistance[newVtx];
+                    if (bestDistance < 0 || distance < bestDistance)
+                    {
+                        bestDistance = distance;
+                        if (expandForward)
+                        {
+                            meetForward = curVtx;
+                            meetBackward = newVtx;
+                            meetMove = moves[i];
+                        }
+                        else
+                        {
+                            meetForward = newVtx;
+                            meetBackward = curVtx;
+                            meetMove.fromPeg = moves[i].toPeg;
+                            meetMove.toPeg = moves[i].fromPeg;
+                        }
+                    }
+                }
+            }
+            BlackenBatch(levelVertices, first, numCurrent);
+        }
+
+        if (bestDistance >= 0)
+        {
+            return bestDistance;
+        }
+        if (sortFrontier)
+        {
+            SortFrontier(nextFrontier);
+        }
+        levelVertices.swap(nextFrontier);
+    }
+    return -1;
+}
+
+//==============================================================================
+//
+// Explore Targets
+//
+// Breadth first search from startState towards every state of a target set
+// at once. Without findAll it stops at the first target discovered, which is
+// a nearest one, and returns its distance; GetSolution then gives the path
+// to it and vtxState[meetForward] says which target it was. With findAll it
+// goes on until every target has been discovered (or the space, or
+// maxDistance, runs out) and returns how many were, after which each
+// target's distance is that of its vertex, if FindVertex has one.
+//
+// Target sets need not share their pegs, so there is no symmetry reduction.
+//
+//==============================================================================
+int Graph::ExploreTargets(StateCode startState, const TargetSet& targets, bool findAll)
+{
+    Reset();
+    realStartState = startState;
+    numSymmetricPegs = 0;
+
+    int startVtx = GetVertex(startState);
+    vtxColor[startVtx] = kVertexColor_Grey;
+    vtxSide[startVtx] = kSearchSide_Forward;
+    size_t numFound = 0;
+    if (targets.Contains(startState, RankState(startState)))
+    {
+        meetForward = startVtx;
+        if (!findAll)
+        {
+            return 0;
+        }
+        numFound++;
+    }
+
+    frontier.assign(1, startVtx);
+    StateCode batchStates[EXPAND_BATCH_STATES];
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move moves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    while (!frontier.empty() && numFound < targets.Size())
+    {
+        if (maxDistance >= 0 && vtxDistance[frontier[0]] >= maxDistance)
+        {
+            break;
+        }
+
+        PEAK_STAT(stats.frontierPeak, frontier.size());
+        nextFrontier.clear();
+        for (size_t first = 0; first < frontier.size(); first += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = GatherBatch(frontier, first, batchStates);
+            int numMoves = ExpandStates(batchStates, numCurrent, numDisks, numPegs,
+                    newStates, moves, parents);
+            COUNT_STAT(stats.statesExpanded, numCurrent);
+            COUNT_STAT(stats.edgesGenerated, numMoves);
+            for (int i = 0; i < numMoves; i++)
+            {
+                int curVtx = frontier[first + parents[i]];
+                StateRank rank = RankState(newStates[i]);
+                int newVtx = GetVertex(newStates[i], rank);
+                if (vtxColor[newVtx] != kVertexColor_White)
+                {
+                    COUNT_STAT(stats.duplicateHits, 1);
+                    continue;
+                }
+
+                vtxPredecessor[newVtx] = curVtx;
+                vtxDistance[newVtx] = vtxDistance[curVtx]+1;
+                vtxColor[newVtx] = kVertexColor_Grey;
+                vtxSide[newVtx] = kSearchSide_Forward;
+                vtxLastMove[newVtx] = moves[i];
+                if (targets.Contains(newStates[i], rank))
+                {
+                    if (!findAll)
+                    {
+                        meetForward = newVtx;
+                        return vtxDistance[newVtx];
+                    }
+                    if (++numFound == targets.Size())
+                    {
+                        return (int)numFound;
+                    }
+                }
+                nextFrontier.push_back(newVtx);
+            }
+            BlackenBatch(frontier, first, numCurrent);
+        }
+
+        if (sortFrontier)
+        {
+            SortFrontier(nextFrontier);
+        }
+        frontier.swap(nextFrontier);
+    }
+    return findAll ? (int)numFound : -1;
+}
+
+//==============================================================================
+//
+// Get Solution
+//
+// Recover the moves found by the last search, in order from startState to
+// endState. The forward chain is walked back from meetForward via the
+// predecessor links; for a bidirectional search the backward chain is then
+// walked from meetBackward towards endState, undoing each recorded move.
+//
+//==============================================================================
+void Graph::GetSolution(std::vector<Move>& moves)
+{
+    moves.clear();
+    if (meetForward == kNoVertex)
+    {
+        return;
+    }
+    if (numSymmetricPegs)
+    {
+        ReplaySolution(moves);
+        return;
+    }
+
+    for (int vtx = meetForward; vtxPredecessor[vtx] != kNoVertex; vtx = vtxPredecessor[vtx])
+    {
+        moves.push_back(vtxLastMove[vtx]);
+    }
+    std::reverse(moves.begin(), moves.end());
+
+    if (meetBackward != kNoVertex)
+    {
+        moves.push_back(meetMove);
+        for (int vtx = meetBackward; vtxPredecessor[vtx] != kNoVertex; vtx = vtxPredecessor[vtx])
+        {
+            Move move;
+            move.fromPeg = vtxLastMove[vtx].toPeg;
+            move.toPeg = vtxLastMove[vtx].fromPeg;
+            moves.push_back(move);
+        }
+    }
+}
+
+
+//==============================================================================
+//
+// Replay Solution
+//
+// For a symmetry-reduced search the recorded moves use the peg labels of
+// canonical states, which need not match the real pegs. Instead, collect the
+// chain of canonical states from start to end and replay it from the real
+// start state, at each step picking the real move whose result has the next
+// canonical state as its representative.
+//
+//==============================================================================
+void Graph::ReplaySolution(std::vector<Move>& moves)
+{
+    std::vector<StateCode> path;
+    for (int vtx = meetForward; vtx != kNoVertex; vtx = vtxPredecessor[vtx])
+    {
+        path.push_back(vtxState[vtx]);
+    }
+    std::reverse(path.begin(), path.end());
+    if (meetBackward != kNoVertex)
+    {
+        for (int vtx = meetBackward; vtx != kNoVertex; vtx = vtxPredecessor[vtx])
+        {
+            path.push_back(vtxState[vtx]);
+        }
+    }
+
+    StateCode curState = realStartState;
+    for (size_t step = 1; step < path.size(); step++)
+    {
+        StateCode newStates[MAX_MOVES_PER_STATE];
+        Move newMoves[MAX_MOVES_PER_STATE];
+        int numMoves = GenerateMoves(curState, numDisks, numPegs, newStates, newMoves);
+        for (int i = 0; i < numMoves; i++)
+        {
+            if (Canonicalize(newStates[i]) == path[step])
+            {
+                curState = newStates[i];
+                moves.push_back(newMoves[i]);
+                break;
+            }
+        }
+    }
+}
+
+//==============================================================================
+//
+// Export Adjacency
+//
+// The search itself never stores edges, but a caller that wants the explored
+// graph can have it materialized here in compressed sparse row form: the
+// neighbors of vertex v are targets[offsets[v]] .. targets[offsets[v+1]-1].
+// Only edges between vertices the last search created are included. With
+// symmetry reduction the vertices are canonical states, so successors are
+// canonicalized too, and several moves reaching one vertex give one edge.
+//
+//==============================================================================
+void Graph::ExportAdjacency(std::vector<int>& offsets, std::vector<int>& targets)
+{
+    offsets.clear();
+    targets.clear();
+    offsets.reserve(numVertices+1);
+
+    for (int vtx = 0; vtx < numVertices; vtx++)
+    {
+        offsets.push_back(targets.size());
+
+        StateCode newStates[MAX_MOVES_PER_STATE];
+        Move moves[MAX_MOVES_PER_STATE];
+        int numMoves = GenerateMoves(vtxState[vtx], numDisks, numPegs, newStates, moves);
+        for (int i = 0; i < numMoves; i++)
+        {
+            int newVtx = FindVertex(Canonicalize(newStates[i]));
+            if (newVtx != kNoVertex &&
+                std::find(targets.begin() + offsets.back(), targets.end(), newVtx) == targets.end())
+            {
+                targets.push_back(newVtx);
+            }
+        }
+    }
+    offsets.push_back(targets.size());
+}
+
+//==============================================================================
+//
+// Class declaration for the thread barrier
+//
+// Blocks each of a fixed number of threads in Wait until all have arrived.
+//
+//==============================================================================
+class Barrier
+{
+public:
+    Barrier(int numThreads) : numThreads(numThreads), numWaiting(0), generation(0) { }
+
+    void Wait(void)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        int arrivedGeneration = generation;
+        if (++numWaiting == numThreads)
+        {
+            numWaiting = 0;
+            generation++;
+            condition.notify_all();
+            return;
+        }
+        while (generation == arrivedGeneration)
+        {
+            condition.wait(guard);
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable condition;
+    int numThreads;
+    int numWaiting;
+    int generation;
+};
+
+//==============================================================================
+//
+// Trace Parent Moves
+//
+// Rebuild the path found by a rank-indexed search, which records for every
+// reached state only the move that reached it: undo moves from endState
+// back to startState, then reverse them. Returns the number of moves.
+//
+//==============================================================================
+static int TraceParentMoves(const PackedMove *parentMoves, int numDisks, int numPegs,
+        StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    moves.clear();
+    for (StateCode state = endState; state != startState; )
+    {
+        Move move = UnpackMove(parentMoves[RankState(state, numDisks, numPegs)]);
+        moves.push_back(move);
+        state = UndoMove(state, numDisks, move);
+    }
+    std::reverse(moves.begin(), moves.end());
+    return moves.size();
+}
+
+//==============================================================================
+//
+// Class declaration for the parallel search
+//
+// A level-synchronous BFS for single large queries. Every state of the
+// puzzle gets one visited bit and one parent move byte, both indexed by
+// state rank, instead of a full vertex. Each BFS level, the threads claim
+// chunks of the frontier, mark new states with an atomic fetch-or on the
+// bitmap (so exactly one thread wins each state and writes its parent move)
+// and collect them in per-thread buffers, which become the next frontier.
+//
+//==============================================================================
+class ParallelSearch
+{
+public:
+    ParallelSearch(int numThreads) : numThreads(numThreads), numDisks(0), numPegs(0),
+        maxMoves(-1), numStates(0), numWords(0), endState(0), found(false) { }
+
+    bool Configure(int numDisks, int numPegs);
+    int Solve(StateCode startState, StateCode endState, std::vector<Move>& moves);
+
+    int numThreads;
+    int numDisks;
+    int numPegs;
+
+    // give up on solutions longer than this (-1 for no limit)
+    int maxMoves;
+
+private:
+    void SearchThread(int index);
+    bool Visit(StateCode state, const Move& move);
+
+    StateRank numStates;
+    size_t numWords;
+    std::unique_ptr<std::atomic<uint64_t>[]> visited;
+    std::unique_ptr<PackedMove[]> parentMoves;
+
+    // state of the search in progress
+    StateCode endState;
+    std::vector<StateCode> frontier;
+    std::vector<std::vector<StateCode> > nextFrontiers;
+    std::atomic<size_t> nextChunk;
+    std::atomic<bool> found;
+    bool done;
+    int distance;
+    std::unique_ptr<Barrier> barrier;
+};
+
+//==============================================================================
+//
+// Parallel Search Configure
+//
+// Size the rank-indexed arrays for a puzzle. Returns false if the state space
+// is too large to give every state its own bit and byte.
+//
+//==============================================================================
+bool ParallelSearch::Configure(int numDisks, int numPegs)
+{
+    if (numDisks == this->numDisks && numPegs == this->numPegs)
+    {
+        return true;
+    }
+
+    StateRank states = 1;
+    for (int i = 0; i < numDisks && states <= MAX_PARALLEL_SEARCH_STATES; i++)
+    {
+        states *= numPegs;
+    }
+    if (states > MAX_PARALLEL_SEARCH_STATES)
+    {
+        return false;
+    }
+
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+    numStates = states;
+    numWords = (numStates + 63) / 64;
+    visited.reset(new std::atomic<uint64_t>[numWords]);
+    parentMoves.reset(new PackedMove[numStates]);
+    return true;
+}
+
+//==============================================================================
+//
+// Visit
+//
+// Claim a newly generated state. Returns true if this call was the first to
+// reach it, in which case the move that reached it is recorded.
+//
+//==============================================================================
+bool ParallelSearch::Visit(StateCode state, const Move& move)
+{
+    StateRank rank = RankState(state, numDisks, numPegs);
+    uint64_t bit = 1ull << (rank % 64);
+    if (visited[rank / 64].load(std::memory_order_relaxed) & bit)
+    {
+        return false;
+    }
+    if (visited[rank / 64].fetch_or(bit, std::memory_order_relaxed) & bit)
+    {
+        return false;
+    }
+    parentMoves[rank] = PackMove(move);
+    return true;
+}
+
+//==============================================================================
+//
+// Search Thread
+//
+// Body run by every thread (the caller is thread 0). Between levels, thread
+// 0 alone stitches the per-thread buffers into the next frontier while the
+// others wait at the barrier.
+//
+//==============================================================================
+void ParallelSearch::SearchThread(int index)
+{
+    std::vector<StateCode>& nextFrontier = nextFrontiers[index];
+    for (;;)
+    {
+        size_t first;
+        while (!found && (first = nextChunk.fetch_add(PARALLEL_SEARCH_CHUNK)) < frontier.size())
+        {
+            size_t last = std::min(first + PARALLEL_SEARCH_CHUNK, frontier.size());
+            for (size_t i = first; i < last; i += EXPAND_BATCH_STATES)
+            {
+                StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+                Move moves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+                int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+                int numStates = std::min((size_t)EXPAND_BATCH_STATES, last - i);
+                int numMoves = ExpandStates(&frontier[i], numStates, numDisks, numPegs,
+                        newStates, moves, parents);
+                for (int j = 0; j < numMoves; j++)
+                {
+                    if (Visit(newStates[j], moves[j]))
+                    {
+                        nextFrontier.push_back(newStates[j]);
+                        if (newStates[j] == endState)
+                        {
+                            found = true;
+                        }
+                    }
+                }
+            }
+        }
+
+        barrier->Wait();
+        if (index == 0)
+        {
+            frontier.clear();
+            for (int t = 0; t < numThreads; t++)
+            {
+                frontier.insert(frontier.end(), nextFrontiers[t].begin(), nextFrontiers[t].end());
+                nextFrontiers[t].clear();
+            }
+            nextChunk = 0;
+            distance++;
+            done = found || frontier.empty() || (maxMoves >= 0 && distance >= maxMoves);
+        }
+        barrier->Wait();
+
+        if (done)
+        {
+            return;
+        }
+    }
+}
+
+//==============================================================================
+//
+// Parallel Search Solve
+//
+// Search from startState until endState is discovered, then rebuild the path
+// backwards from endState by undoing the recorded parent moves.
+//
+//==============================================================================
+int ParallelSearch::Solve(StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    moves.clear();
+    if (startState == endState)
+    {
+        return 0;
+    }
+    if (maxMoves == 0)
+    {
+        return -1;
+    }
+
+    for (size_t i = 0; i < numWords; i++)
+    {
+        visited[i].store(0, std::memory_order_relaxed);
+    }
+
+    this->endState = endState;
+    StateRank startRank = RankState(startState, numDisks, numPegs);
+    visited[startRank / 64] |= 1ull << (startRank % 64);
+    frontier.assign(1, startState);
+    nextFrontiers.resize(numThreads);
+    nextChunk = 0;
+    found = false;
+    done = false;
+    distance = 0;
+    barrier.reset(new Barrier(numThreads));
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < numThreads; i++)
+    {
+        threads.push_back(std::thread(&ParallelSearch::SearchThread, this, i));
+    }
+    SearchThread(0);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+
+    if (!found)
+    {
+        return -1;
+    }
+    return TraceParentMoves(parentMoves.get(), numDisks, numPegs, startState, endState, moves);
+}
+
+//==============================================================================
+//
+// Class declaration for the search heuristics
+//
+// A heuristic estimates the number of moves from a state to the goal set by
+// SetGoal. Informed searches rely on it never overestimating (admissible),
+// which is what keeps their answers minimal.
+//
+//==============================================================================
+class Heuristic
+{
+public:
+    virtual ~Heuristic() { }
+
+    virtual void SetGoal(int numDisks, int numPegs, StateCode endState) = 0;
+    virtual int Estimate(StateCode state) = 0;
+};
+
+//==============================================================================
+//
+// Class declaration for the misplaced disk heuristic
+//
+// Every disk off its target peg must move at least once. Let D be the largest
+// such disk: before D can move, every smaller disk must be off both D's
+// current and target pegs. A smaller disk that is already home on one of
+// those two pegs has to leave and come back, which is at least two moves.
+// Each of these bounds counts moves of a different disk, so their sum is
+// still a lower bound.
+//
+//==============================================================================
+class MisplacedDiskHeuristic : public Heuristic
+{
+public:
+    MisplacedDiskHeuristic() : numDisks(0), endState(0) { }
+
+    void SetGoal(int numDisks, int /*numPegs*/, StateCode endState)
+    {
+        this->numDisks = numDisks;
+        this->endState = endState;
+    }
+
+    int Estimate(StateCode state);
+
+private:
+    int numDisks;
+    StateCode endState;
+};
+
+int MisplacedDiskHeuristic::Estimate(StateCode state)
+{
+    int disk = numDisks-1;
+    while (disk >= 0 && StateCodec::GetPeg(state, disk) == StateCodec::GetPeg(endState, disk))
+    {
+        disk--;
+    }
+    if (disk < 0)
+    {
+        return 0;
+    }
+
+    int fromPeg = StateCodec::GetPeg(state, disk);
+    int toPeg = StateCodec::GetPeg(endState, disk);
+    int estimate = 1;
+    while (--disk >= 0)
+    {
+        int peg = StateCodec::GetPeg(state, disk);
+        if (peg != (int)StateCodec::GetPeg(endState, disk))
+        {
+            estimate += 1;
+        }
+        else if (peg == fromPeg || peg == toPeg)
+        {
+            estimate += 2;
+        }
+    }
+    return estimate;
+}
+
+//==============================================================================
+//
+// Class declaration for the search engines
+//
+// A search engine finds a minimal sequence of moves between two states of an
+// (N, K) puzzle, returning its length (or -1 if there is none) and filling in
+// the moves. Engines keep their buffers between calls.
+//
+//==============================================================================
+class SearchEngine
+{
+public:
+    SearchEngine() : maxMoves(-1), stats(), timePhases(false) { }
+    virtual ~SearchEngine() { }
+
+    // give up on solutions longer than this (-1 for no limit)
+    int maxMoves;
+
+    // counters of the last Solve, and whether it times path reconstruction
+    SearchStats stats;
+    bool timePhases;
+
+    virtual int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves) = 0;
+};
+
+//==============================================================================
+//
+// Breadth first search engine
+//
+// The original graph search, one- or two-sided, on a caller owned graph.
+//
+//==============================================================================
+class BfsEngine : public SearchEngine
+{
+public:
+    BfsEngine(Graph& graph, bool bidirectional) : graph(graph), bidirectional(bidirectional) { }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves)
+    {
+        graph.Configure(numDisks, numPegs);
+        graph.maxDistance = maxMoves;
+        int numMoves;
+        if (bidirectional)
+        {
+            numMoves = graph.BuildAndExploreBidirectional(startState, endState);
+        }
+        else
+        {
+            numMoves = graph.BuildAndExplore(startState, endState);
+        }
+
+        double start = timePhases ? CurrentSeconds() : 0;
+        graph.GetSolution(moves);
+        stats = graph.stats;
+        COUNT_STAT(stats.verticesCreated, graph.numVertices);
+        if (timePhases)
+        {
+            stats.pathSeconds = CurrentSeconds() - start;
+        }
+        return numMoves;
+    }
+
+private:
+    Graph& graph;
+    bool bidirectional;
+};
+
+//==============================================================================
+//
+// A* search engine
+//
+// Best first search ordered by distance plus estimate. Each reached state
+// keeps its best known distance and the move that achieved it; a state
+// reached again by a shorter path is simply queued again (stale queue
+// entries are skipped when popped), so the answer stays minimal even if the
+// heuristic is admissible but not consistent.
+//
+//==============================================================================
+class AStarEngine : public SearchEngine
+{
+public:
+    AStarEngine(Heuristic& heuristic) : heuristic(heuristic) { }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    typedef struct Node
+    {
+        int distance;
+        PackedMove lastMove;
+    } Node;
+
+    typedef struct OpenEntry
+    {
+        int estimate;
+        int distance;
+        StateCode state;
+
+        // the heap pops the lowest estimate, preferring deeper states on ties
+        bool operator<(const OpenEntry& other) const
+        {
+            if (estimate != other.estimate)
+            {
+                return estimate > other.estimate;
+            }
+            return distance < other.distance;
+        }
+    } OpenEntry;
+
+    Heuristic& heuristic;
+    std::unordered_map<StateCode, Node> nodes;
+    std::vector<OpenEntry> open;
+};
+
+int AStarEngine::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    moves.clear();
+    nodes.clear();
+    open.clear();
+    stats = SearchStats();
+    heuristic.SetGoal(numDisks, numPegs, endState);
+
+    Node startNode = { 0, 0 };
+    nodes[startState] = startNode;
+    OpenEntry startEntry = { heuristic.Estimate(startState), 0, startState };
+    open.push_back(startEntry);
+
+    StateCode newStates[MAX_MOVES_PER_STATE];
+    Move newMoves[MAX_MOVES_PER_STATE];
+    while (!open.empty())
+    {
+        std::pop_heap(open.begin(), open.end());
+        OpenEntry entry = open.back();
+        open.pop_back();
+        if (entry.distance != nodes[entry.state].distance)
+        {
+            continue;
+        }
+
+        if (entry.state == endState)
+        {
+            double start = timePhases ? CurrentSeconds() : 0;
+            for (StateCode state = endState; state != startState; )
+            {
+                Move move = UnpackMove(nodes[state].lastMove);
+                moves.push_back(move);
+                state = UndoMove(state, numDisks, move);
+            }
+            std::reverse(moves.begin(), moves.end());
+            COUNT_STAT(stats.verticesCreated, nodes.size());
+            if (timePhases)
+            {
+                stats.pathSeconds = CurrentSeconds() - start;
+            }
+            return entry.distance;
+        }
+
+        PEAK_STAT(stats.frontierPeak, open.size() + 1);
+        int numMoves = GenerateMoves(entry.state, numDisks, numPegs, newStates, newMoves);
+        COUNT_STAT(stats.statesExpanded, 1);
+        COUNT_STAT(stats.edgesGenerated, numMoves);
+        for (int i = 0; i < numMoves; i++)
+        {
+            int distance = entry.distance+1;
+            std::unordered_map<StateCode, Node>::iterator it = nodes.find(newStates[i]);
+            if (it != nodes.end())
+            {
+                COUNT_STAT(stats.duplicateHits, 1);
+                if (it->second.distance <= distance)
+                {
+                    continue;
+                }
+            }
+
+            // the estimate never overshoots, so this state cannot lead to a
+            // solution within maxMoves
+            int estimate = distance + heuristic.Estimate(newStates[i]);
+            if (maxMoves >= 0 && estimate > maxMoves)
+            {
+                continue;
+            }
+
+            Node node = { distance, PackMove(newMoves[i]) };
+            nodes[newStates[i]] = node;
+            OpenEntry newEntry = { estimate, distance, newStates[i] };
+            open.push_back(newEntry);
+            std::push_heap(open.begin(), open.end());
+        }
+    }
+    COUNT_STAT(stats.verticesCreated, nodes.size());
+    return -1;
+}
+
+//==============================================================================
+//
+// IDA* search engine
+//
+// Iterative deepening on distance plus estimate: a depth first search that
+// abandons any path whose estimate exceeds the bound, repeated with the
+// smallest estimate that exceeded it until the goal is reached. Memory is
+// only the current path, so with no record of visited states the search
+// prunes the two cheap sources of repeats instead: moving the same disk
+// twice in a row (never part of a minimal solution), and the two orders of
+// a pair of consecutive moves between four distinct pegs, which commute and
+// are only tried with the lower "from" peg first.
+//
+//==============================================================================
+class IdaStarEngine : public SearchEngine
+{
+public:
+    IdaStarEngine(Heuristic& heuristic) : heuristic(heuristic) { }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    enum { kFound = -1 };
+
+    int Explore(StateCode state, int distance, const Move& lastMove);
+
+    Heuristic& heuristic;
+    int numDisks;
+    int numPegs;
+    StateCode endState;
+    int bound;
+    std::vector<Move> path;
+};
+
+//==============================================================================
+//
+// Explore
+//
+// Depth first search below state. Returns kFound if the goal was reached
+// (leaving the moves in path), else the smallest estimate beyond the bound.
+// lastMove is the move that reached state.
+//
+//==============================================================================
+int IdaStarEngine::Explore(StateCode state, int distance, const Move& lastMove)
+{
+    int estimate = distance + heuristic.Estimate(state);
+    if (estimate > bound)
+    {
+        return estimate;
+    }
+    if (state == endState)
+    {
+        return kFound;
+    }
+
+    StateCode newStates[MAX_MOVES_PER_STATE];
+    Move newMoves[MAX_MOVES_PER_STATE];
+    int numMoves = GenerateMoves(state, numDisks, numPegs, newStates, newMoves);
+    COUNT_STAT(stats.statesExpanded, 1);
+    COUNT_STAT(stats.edgesGenerated, numMoves);
+    int nextBound = INT32_MAX;
+    for (int i = 0; i < numMoves; i++)
+    {
+        const Move& move = newMoves[i];
+        if (move.fromPeg == lastMove.toPeg)
+        {
+            continue;
+        }
+        if (move.fromPeg < lastMove.fromPeg && move.toPeg != lastMove.fromPeg &&
+                move.fromPeg != lastMove.toPeg && move.toPeg != lastMove.toPeg)
+        {
+            continue;
+        }
+
+        path.push_back(move);
+        int result = Explore(newStates[i], distance+1, move);
+        if (result == kFound)
+        {
+            return kFound;
+        }
+        path.pop_back();
+        nextBound = std::min(nextBound, result);
+    }
+    return nextBound;
+}
+
+int IdaStarEngine::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+    this->endState = endState;
+    heuristic.SetGoal(numDisks, numPegs, endState);
+
+    path.clear();
+    stats = SearchStats();
+    bound = heuristic.Estimate(startState);
+    for (;;)
+    {
+        // nothing lands on peg kMaxPegs or starts below peg 0, so the first
+        // move is never pruned
+        Move noMove = { 0, StateCodec::kMaxPegs };
+        int result = Explore(startState, 0, noMove);
+        if (result == kFound)
+        {
+            moves = path;
+            return moves.size();
+        }
+        if (result == INT32_MAX || (maxMoves >= 0 && result > maxMoves))
+        {
+            moves.clear();
+            return -1;
+        }
+        bound = result;
+    }
+}
+
+//==============================================================================
+//
+// Lean search engine
+//
+// A breadth first search that keeps no vertices at all: one visited bit and
+// one parent move byte per state, indexed by state rank, plus the current
+// and next BFS levels. That is about 1.1 bytes per possible state, so spaces
+// of tens of millions of states fit in a few tens of megabytes. The path is
+// recovered by undoing parent moves from endState. Puzzles too large to give
+// every state its bit and byte are passed to the fallback engine (IDA*,
+// which stores no graph), saying so on std::cerr once per puzzle size.
+//
+//==============================================================================
+class LeanSearch : public SearchEngine
+{
+public:
+    LeanSearch(SearchEngine& fallback, const char *fallbackName) :
+        fallback(fallback), fallbackName(fallbackName), numDisks(0), numPegs(0)
+    {
+        memset(reportedSizes, 0, sizeof(reportedSizes));
+    }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    bool Configure(int numDisks, int numPegs);
+
+    SearchEngine& fallback;
+    const char *fallbackName;
+    uint32_t reportedSizes[StateCodec::kMaxDisks + 1];   // bit K for a reported (N, K)
+    int numDisks;
+    int numPegs;
+    std::vector<uint64_t> visited;
+    std::vector<PackedMove> parentMoves;
+    std::vector<StateCode> frontier;
+    std::vector<StateCode> nextFrontier;
+};
+
+//==============================================================================
+//
+// Lean Search Configure
+//
+// size the rank-indexed arrays, returning false if the space is too large
+//
+//==============================================================================
+bool LeanSearch::Configure(int numDisks, int numPegs)
+{
+    if (numDisks == this->numDisks && numPegs == this->numPegs)
+    {
+        return true;
+    }
+
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks && numStates <= MAX_LEAN_SEARCH_STATES; i++)
+    {
+        numStates *= numPegs;
+    }
+    if (numStates > MAX_LEAN_SEARCH_STATES)
+    {
+        return false;
+    }
+
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+    visited.assign((numStates + 63) / 64, 0);
+    parentMoves.assign(numStates, 0);
+    return true;
+}
+
+//==============================================================================
+//
+// Lean Search Solve
+//
+// Expand one BFS level at a time, stopping as soon as endState is discovered
+// rather than when it is dequeued.
+//
+//==============================================================================
+int LeanSearch::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    if (!Configure(numDisks, numPegs))
+    {
+        if (!(reportedSizes[numDisks] & (1u << numPegs)))
+        {
+            std::cerr << "lean search: " << numDisks << " disks on " << numPegs
+                      << " pegs is too big to index, using " << fallbackName << " instead"
+                      << std::endl;
+            reportedSizes[numDisks] |= 1u << numPegs;
+        }
+        fallback.timePhases = timePhases;
+        int numMoves = fallback.Solve(numDisks, numPegs, startState, endState, moves);
+        stats = fallback.stats;
+        return numMoves;
+    }
+
+    moves.clear();
+    stats = SearchStats();
+    if (startState == endState)
+    {
+        return 0;
+    }
+
+    std::fill(visited.begin(), visited.end(), 0);
+    COUNT_STAT(stats.verticesCreated, 1);
+    StateRank startRank = RankState(startState, numDisks, numPegs);
+    visited[startRank / 64] |= 1ull << (startRank % 64);
+    frontier.assign(1, startState);
+
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move newMoves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    for (int distance = 0; !frontier.empty(); distance++)
+    {
+        if (maxMoves >= 0 && distance >= maxMoves)
+        {
+            return -1;
+        }
+
+        PEAK_STAT(stats.frontierPeak, frontier.size());
+        nextFrontier.clear();
+        for (size_t first = 0; first < frontier.size(); first += EXPAND_BATCH_STATES)
+        {
+            int numStates = std::min((size_t)EXPAND_BATCH_STATES, frontier.size() - first);
+            int numMoves = ExpandStates(&frontier[first], numStates, numDisks, numPegs,
+                    newStates, newMoves, parents);
+            COUNT_STAT(stats.statesExpanded, numStates);
+            COUNT_STAT(stats.edgesGenerated, numMoves);
+            for (int i = 0; i < numMoves; i++)
+            {
+                StateRank rank = RankState(newStates[i], numDisks, numPegs);
+                uint64_t bit = 1ull << (rank % 64);
+                if (visited[rank / 64] & bit)
+                {
+                    COUNT_STAT(stats.duplicateHits, 1);
+                    continue;
+                }
+                visited[rank / 64] |= bit;
+                COUNT_STAT(stats.verticesCreated, 1);
+                parentMoves[rank] = PackMove(newMoves[i]);
+                if (newStates[i] == endState)
+                {
+                    double start = timePhases ? CurrentSeconds() : 0;
+                    int pathMoves = TraceParentMoves(&parentMoves[0], numDisks, numPegs,
+                            startState, endState, moves);
+                    if (timePhases)
+                    {
+                        stats.pathSeconds = CurrentSeconds() - start;
+                    }
+                    return pathMoves;
+                }
+                nextFrontier.push_back(newStates[i]);
+            }
+        }
+        frontier.swap(nextFrontier);
+    }
+    return -1;
+}
+
+//==============================================================================
+//
+// External search engine
+//
+// A breadth first search for state spaces too large for memory. Every BFS
+// layer lives in its own file in workDir as a sorted array of state codes,
+// read back through mmap. Expanding a layer buffers successors in memory and
+// writes them out as sorted runs of up to EXTERNAL_RUN_STATES states; the
+// runs are then merged into the next layer. Duplicates are removed during
+// the merge rather than as states are generated (delayed duplicate
+// detection): since moves are reversible, a successor of layer d can only
+// already be in layer d-1 or d, so those two layers are all the merge has to
+// subtract. The path is rebuilt from endState back down by looking for a
+// neighbor in each earlier layer, using binary search on its file.
+//
+//==============================================================================
+class ExternalSearch : public SearchEngine
+{
+public:
+    ExternalSearch(const char *workDir) :
+        workDir(workDir), instance(nextInstance++), numDisks(0), numPegs(0) { }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    typedef struct StateFile
+    {
+        void *mapping;
+        size_t mappingSize;
+        const StateCode *states;
+        size_t numStates;
+    } StateFile;
+
+    std::string FileName(const char *kind, int index);
+    bool MapStates(const std::string& fileName, StateFile& file);
+    void UnmapStates(StateFile& file);
+    bool Contains(const StateFile& file, StateCode state);
+    bool WriteRun(int index);
+    bool MergeRuns(int numRuns, int distance, const StateFile& prevLayer,
+            const StateFile& curLayer, StateCode endState, size_t& layerSize, bool& found);
+    bool TracePath(int distance, StateCode startState, StateCode endState, std::vector<Move>& moves);
+
+    static std::atomic<int> nextInstance;
+
+    std::string workDir;
+    int instance;
+    int numDisks;
+    int numPegs;
+    std::vector<StateCode> runBuffer;
+};
+
+std::atomic<int> ExternalSearch::nextInstance(0);
+
+//==============================================================================
+//
+// External Search File Name
+//
+// layer and run files are named after the process and the engine, so
+// concurrent searches (other processes, or the workers of a --jobs batch)
+// can share a directory
+//
+//==============================================================================
+std::string ExternalSearch::FileName(const char *kind, int index)
+{
+    char name[96];
+    snprintf(name, sizeof(name), "/hanoi-%d-%d-%s-%d.bin", (int)getpid(), instance, kind, index);
+    return workDir + name;
+}
+
+//==============================================================================
+//
+// Map States / Unmap States
+//
+// Memory-map a file of state codes read-only. An empty file maps to an
+// empty array.
+//
+//==============================================================================
+bool ExternalSearch::MapStates(const std::string& fileName, StateFile& file)
+{
+    file.mapping = NULL;
+    file.mappingSize = 0;
+    file.states = NULL;
+    file.numStates = 0;
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+
+    struct stat fileInfo;
+    bool ok = fstat(fd, &fileInfo) == 0;
+    if (ok && fileInfo.st_size > 0)
+    {
+        void *data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            ok = false;
+        }
+        else
+        {
+            file.mapping = data;
+            file.mappingSize = fileInfo.st_size;
+            file.states = (const StateCode *)data;
+            file.numStates = fileInfo.st_size / sizeof(StateCode);
+        }
+    }
+    close(fd);
+    if (!ok)
+    {
+        std::cerr << "cannot map " << fileName << std::endl;
+    }
+    return ok;
+}
+
+void ExternalSearch::UnmapStates(StateFile& file)
+{
+    if (file.mapping)
+    {
+        munmap(file.mapping, file.mappingSize);
+    }
+    file.mapping = NULL;
+    file.mappingSize = 0;
+    file.states = NULL;
+    file.numStates = 0;
+}
+
+bool ExternalSearch::Contains(const StateFile& file, StateCode state)
+{
+    return std::binary_search(file.states, file.states + file.numStates, state);
+}
+
+//==============================================================================
+//
+// Write Run
+//
+// sort the buffered successors, drop repeats and write them as a run file
+//
+//==============================================================================
+bool ExternalSearch::WriteRun(int index)
+{
+    std::sort(runBuffer.begin(), runBuffer.end());
+    runBuffer.erase(std::unique(runBuffer.begin(), runBuffer.end()), runBuffer.end());
+
+    std::string fileName = FileName("run", index);
+    FILE *file = fopen(fileName.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&runBuffer[0], sizeof(StateCode), runBuffer.size(), file) == runBuffer.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        std::cerr << "failed writing " << fileName << std::endl;
+    }
+    runBuffer.clear();
+    return ok;
+}
+
+//==============================================================================
+//
+// Merge Runs
+//
+// Merge the sorted runs of one expansion into the layer file for distance,
+// keeping each state once and skipping any state already in the previous or
+// current layer. Sets found if endState turns up in the new layer.
+//
+//==============================================================================
+bool ExternalSearch::MergeRuns(int numRuns, int distance, const StateFile& prevLayer,
+        const StateFile& curLayer, StateCode endState, size_t& layerSize, bool& found)
+{
+    std::vector<StateFile> runs(numRuns);
+    bool ok = true;
+    for (int i = 0; i < numRuns; i++)
+    {
+        ok = MapStates(FileName("run", i), runs[i]) && ok;
+    }
+
+    std::string fileName = FileName("layer", distance);
+    FILE *file = ok ? fopen(fileName.c_str(), "wb") : NULL;
+    if (ok && !file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        ok = false;
+    }
+
+    // heap of (next state, run) pairs, smallest state on top
+    typedef std::pair<StateCode, int> RunHead;
+    std::vector<RunHead> heads;
+    std::vector<size_t> positions(numRuns, 0);
+    for (int i = 0; ok && i < numRuns; i++)
+    {
+        if (runs[i].numStates)
+        {
+            heads.push_back(RunHead(runs[i].states[0], i));
+        }
+    }
+    std::greater<RunHead> order;
+    std::make_heap(heads.begin(), heads.end(), order);
+
+    size_t prevPos = 0;
+    size_t curPos = 0;
+    bool havePrevious = false;
+    StateCode previous = 0;
+    layerSize = 0;
+    found = false;
+    while (ok && !heads.empty())
+    {
+        std::pop_heap(heads.begin(), heads.end(), order);
+        RunHead head = heads.back();
+        heads.pop_back();
+        int run = head.second;
+        if (++positions[run] < runs[run].numStates)
+        {
+            heads.push_back(RunHead(runs[run].states[positions[run]], run));
+            std::push_heap(heads.begin(), heads.end(), order);
+        }
+
+        StateCode state = head.first;
+        if (havePrevious && state == previous)
+        {
+            continue;
+        }
+        havePrevious = true;
+        previous = state;
+
+        // the merged states come out in order, so the older layers are
+        // scanned alongside them
+        while (prevPos < prevLayer.numStates && prevLayer.states[prevPos] < state)
+        {
+            prevPos++;
+        }
+        while (curPos < curLayer.numStates && curLayer.states[curPos] < state)
+        {
+            curPos++;
+        }
+        if ((prevPos < prevLayer.numStates && prevLayer.states[prevPos] == state) ||
+                (curPos < curLayer.numStates && curLayer.states[curPos] == state))
+        {
+            continue;
+        }
+
+        ok = fwrite(&state, sizeof(state), 1, file) == 1;
+        layerSize++;
+        found = found || state == endState;
+    }
+
+    if (file)
+    {
+        ok = (fclose(file) == 0) && ok;
+        if (!ok)
+        {
+            std::cerr << "failed writing " << fileName << std::endl;
+        }
+    }
+    for (int i = 0; i < numRuns; i++)
+    {
+        UnmapStates(runs[i]);
+        unlink(FileName("run", i).c_str());
+    }
+    return ok;
+}
+
+//==============================================================================
+//
+// Trace Path
+//
+// Walk from endState (in the layer for distance) down to startState: at each
+// step some neighbor of the current state is in the layer below, and the
+// move to it, reversed, is the next move from the end.
+//
+//==============================================================================
+bool ExternalSearch::TracePath(int distance, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    moves.clear();
+    StateCode state = endState;
+    for (int layer = distance-1; layer >= 0; layer--)
+    {
+        StateFile file;
+        if (!MapStates(FileName("layer", layer), file))
+        {
+            return false;
+        }
+
+        StateCode newStates[MAX_MOVES_PER_STATE];
+        Move newMoves[MAX_MOVES_PER_STATE];
+        int numMoves = GenerateMoves(state, numDisks, numPegs, newStates, newMoves);
+        int i = 0;
+        while (i < numMoves && !Contains(file, newStates[i]))
+        {
+            i++;
+        }
+        UnmapStates(file);
+        if (i == numMoves)
+        {
+            // only possible with a corrupt layer file
+            std::cerr << "no predecessor in layer " << layer << std::endl;
+            return false;
+        }
+
+        Move move = { newMoves[i].toPeg, newMoves[i].fromPeg };
+        moves.push_back(move);
+        state = newStates[i];
+    }
+    std::reverse(moves.begin(), moves.end());
+    return state == startState;
+}
+
+//==============================================================================
+//
+// External Search Solve
+//
+//==============================================================================
+int ExternalSearch::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    moves.clear();
+    if (startState == endState)
+    {
+        return 0;
+    }
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+
+    runBuffer.assign(1, startState);
+    bool ok = WriteRun(0) && rename(FileName("run", 0).c_str(), FileName("layer", 0).c_str()) == 0;
+
+    StateFile prevLayer = { NULL, 0, NULL, 0 };
+    StateFile curLayer = { NULL, 0, NULL, 0 };
+    ok = ok && MapStates(FileName("layer", 0), curLayer);
+
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move newMoves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int distance = 0;
+    int result = -1;
+    while (ok && (maxMoves < 0 || distance < maxMoves))
+    {
+        // expand the current layer into sorted runs
+        int numRuns = 0;
+        runBuffer.clear();
+        for (size_t first = 0; ok && first < curLayer.numStates; first += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = std::min((size_t)EXPAND_BATCH_STATES, curLayer.numStates - first);
+            int numMoves = ExpandStates(curLayer.states + first, numCurrent, numDisks, numPegs,
+                    newStates, newMoves, parents);
+            runBuffer.insert(runBuffer.end(), newStates, newStates + numMoves);
+            if (runBuffer.size() >= EXTERNAL_RUN_STATES)
+            {
+                ok = WriteRun(numRuns++);
+            }
+        }
+        if (ok && !runBuffer.empty())
+        {
+            ok = WriteRun(numRuns++);
+        }
+
+        size_t layerSize = 0;
+        bool found = false;
+        ok = ok && MergeRuns(numRuns, distance+1, prevLayer, curLayer, endState, layerSize, found);
+        distance++;
+        if (!ok || layerSize == 0)
+        {
+            break;
+        }
+        if (found)
+        {
+            result = distance;
+            break;
+        }
+
+        UnmapStates(prevLayer);
+        prevLayer = curLayer;
+        ok = MapStates(FileName("layer", distance), curLayer);
+    }
+    UnmapStates(prevLayer);
+    UnmapStates(curLayer);
+
+    if (ok && result >= 0 && !TracePath(result, startState, endState, moves))
+    {
+        moves.clear();
+        result = -1;
+    }
+    for (int layer = 0; layer <= distance; layer++)
+    {
+        unlink(FileName("layer", layer).c_str());
+    }
+    return result;
+}
+
+//==============================================================================
+//
+// Class declaration for the communicator
+//
+// How the nodes of a distributed search talk to each other. Every call is
+// collective: all nodes make the same calls in the same order. Exchange
+// delivers outgoing[i] to node i and gathers everything sent to this node
+// into incoming; Sum adds a value over all nodes; Broadcast hands the root's
+// value to every node.
+//
+//==============================================================================
+typedef struct StateMessage
+{
+    StateCode state;
+    PackedMove move;
+} StateMessage;
+
+class Communicator
+{
+public:
+    virtual ~Communicator() { }
+
+    virtual int Rank(void) = 0;
+    virtual int Size(void) = 0;
+    virtual void Exchange(std::vector<std::vector<StateMessage> >& outgoing,
+            std::vector<StateMessage>& incoming) = 0;
+    virtual uint64_t Sum(uint64_t value) = 0;
+    virtual int Broadcast(int value, int root) = 0;
+};
+
+//==============================================================================
+//
+// In-process communicator
+//
+// Nodes are threads of one process sharing a LocalNetwork: a mailbox for
+// every (sender, receiver) pair and one value slot per node, with a barrier
+// separating the writes of each collective from the reads.
+//
+//==============================================================================
+typedef struct LocalNetwork
+{
+    LocalNetwork(int numNodes) : numNodes(numNodes), barrier(numNodes),
+        mailboxes(numNodes * numNodes), values(numNodes, 0) { }
+
+    int numNodes;
+    Barrier barrier;
+    std::vector<std::vector<StateMessage> > mailboxes;
+    std::vector<uint64_t> values;
+} LocalNetwork;
+
+class LocalCommunicator : public Communicator
+{
+public:
+    LocalCommunicator(LocalNetwork& network, int rank) : network(network), rank(rank) { }
+
+    int Rank(void) { return rank; }
+    int Size(void) { return network.numNodes; }
+
+    void Exchange(std::vector<std::vector<StateMessage> >& outgoing,
+            std::vector<StateMessage>& incoming)
+    {
+        int numNodes = network.numNodes;
+        for (int i = 0; i < numNodes; i++)
+        {
+            network.mailboxes[rank * numNodes + i].swap(outgoing[i]);
+            outgoing[i].clear();
+        }
+        network.barrier.Wait();
+
+        incoming.clear();
+        for (int i = 0; i < numNodes; i++)
+        {
+            std::vector<StateMessage>& mailbox = network.mailboxes[i * numNodes + rank];
+            incoming.insert(incoming.end(), mailbox.begin(), mailbox.end());
+            mailbox.clear();
+        }
+        network.barrier.Wait();
+    }
+
+    uint64_t Sum(uint64_t value)
+    {
+        network.values[rank] = value;
+        network.barrier.Wait();
+        uint64_t total = 0;
+        for (int i = 0; i < network.numNodes; i++)
+        {
+            total += network.values[i];
+        }
+        network.barrier.Wait();
+        return total;
+    }
+
+    int Broadcast(int value, int root)
+    {
+        if (rank == root)
+        {
+            network.values[root] = value;
+        }
+        network.barrier.Wait();
+        value = network.values[root];
+        network.barrier.Wait();
+        return value;
+    }
+
+private:
+    LocalNetwork& network;
+    int rank;
+};
+
+#ifdef FBHANOI_USE_MPI
+//==============================================================================
+//
+// MPI communicator
+//
+// One node per MPI process of MPI_COMM_WORLD. Messages travel as raw bytes,
+// so all processes must run the same build on the same architecture.
+//
+//==============================================================================
+class MpiCommunicator : public Communicator
+{
+public:
+    int Rank(void)
+    {
+        int rank;
+        MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+        return rank;
+    }
+
+    int Size(void)
+    {
+        int size;
+        MPI_Comm_size(MPI_COMM_WORLD, &size);
+        return size;
+    }
+
+    void Exchange(std::vector<std::vector<StateMessage> >& outgoing,
+            std::vector<StateMessage>& incoming)
+    {
+        int numNodes = Size();
+        std::vector<int> sendCounts(numNodes), sendOffsets(numNodes);
+        std::vector<int> receiveCounts(numNodes), receiveOffsets(numNodes);
+        std::vector<StateMessage> sendBuffer;
+        for (int i = 0; i < numNodes; i++)
+        {
+            sendOffsets[i] = sendBuffer.size() * sizeof(StateMessage);
+            sendCounts[i] = outgoing[i].size() * sizeof(StateMessage);
+            sendBuffer.insert(sendBuffer.end(), outgoing[i].begin(), outgoing[i].end());
+            outgoing[i].clear();
+        }
+        MPI_Alltoall(&sendCounts[0], 1, MPI_INT, &receiveCounts[0], 1, MPI_INT, MPI_COMM_WORLD);
+
+        int receiveBytes = 0;
+        for (int i = 0; i < numNodes; i++)
+        {
+            receiveOffsets[i] = receiveBytes;
+            receiveBytes += receiveCounts[i];
+        }
+        incoming.resize(receiveBytes / sizeof(StateMessage));
+        MPI_Alltoallv(sendBuffer.empty() ? NULL : &sendBuffer[0], &sendCounts[0], &sendOffsets[0],
+                MPI_BYTE, incoming.empty() ? NULL : &incoming[0], &receiveCounts[0],
+                &receiveOffsets[0], MPI_BYTE, MPI_COMM_WORLD);
+    }
+
+    uint64_t Sum(uint64_t value)
+    {
+        uint64_t total;
+        MPI_Allreduce(&value, &total, 1, MPI_UINT64_T, MPI_SUM, MPI_COMM_WORLD);
+        return total;
+    }
+
+    int Broadcast(int value, int root)
+    {
+        MPI_Bcast(&value, 1, MPI_INT, root, MPI_COMM_WORLD);
+        return value;
+    }
+};
+#endif
+
+//==============================================================================
+//
+// Distributed search engine
+//
+// A level-synchronous BFS spread over the nodes of a communicator. Each
+// state is owned by one node, picked by hashing its code; a node records the
+// move that first reached each state it owns and holds its share of the
+// frontier. Per level, every node expands its frontier with the ordinary
+// move generator and sends each successor, with its move, to the owner,
+// which keeps the ones it had not seen as its part of the next level. The
+// path is then walked back from endState one move at a time, each move
+// broadcast by the owner of the state it reached.
+//
+// With a communicator, this process is one node of a larger search (MPI);
+// without one, Solve runs numNodes nodes on threads of this process.
+//
+//==============================================================================
+class DistributedSearch : public SearchEngine
+{
+public:
+    DistributedSearch(Communicator *communicator, int numNodes) :
+        communicator(communicator), numNodes(numNodes) { }
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    static int Owner(StateCode state, int numNodes)
+    {
+        return (int)((((uint64_t)state * 0x9e3779b97f4a7c15ull) >> 32) % numNodes);
+    }
+
+    int RunNode(Communicator& comm, int numDisks, int numPegs, StateCode startState,
+            StateCode endState, std::vector<Move>& moves);
+
+    Communicator *communicator;
+    int numNodes;
+};
+
+//==============================================================================
+//
+// Run Node
+//
+// the part of the search done by one node; every node returns the same result
+//
+//==============================================================================
+int DistributedSearch::RunNode(Communicator& comm, int numDisks, int numPegs,
+        StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    moves.clear();
+    if (startState == endState)
+    {
+        return 0;
+    }
+
+    int rank = comm.Rank();
+    int size = comm.Size();
+    std::unordered_map<StateCode, PackedMove> parentMoves;
+    std::vector<StateCode> frontier;
+    std::vector<StateCode> nextFrontier;
+    if (Owner(startState, size) == rank)
+    {
+        parentMoves[startState] = 0;
+        frontier.push_back(startState);
+    }
+
+    std::vector<std::vector<StateMessage> > outgoing(size);
+    std::vector<StateMessage> incoming;
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move newMoves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    bool found = false;
+    for (int distance = 0; !found && (maxMoves < 0 || distance < maxMoves); distance++)
+    {
+        for (size_t first = 0; first < frontier.size(); first += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = std::min((size_t)EXPAND_BATCH_STATES, frontier.size() - first);
+            int numMoves = ExpandStates(&frontier[first], numCurrent, numDisks, numPegs,
+                    newStates, newMoves, parents);
+            for (int i = 0; i < numMoves; i++)
+            {
+                StateMessage message = { newStates[i], PackMove(newMoves[i]) };
+                outgoing[Owner(newStates[i], size)].push_back(message);
+            }
+        }
+        comm.Exchange(outgoing, incoming);
+
+        bool foundHere = false;
+        nextFrontier.clear();
+        for (size_t i = 0; i < incoming.size(); i++)
+        {
+            if (parentMoves.insert(std::make_pair(incoming[i].state, incoming[i].move)).second)
+            {
+                nextFrontier.push_back(incoming[i].state);
+                foundHere = foundHere || incoming[i].state == endState;
+            }
+        }
+        frontier.swap(nextFrontier);
+
+        found = comm.Sum(foundHere) > 0;
+        if (!found && comm.Sum(frontier.size()) == 0)
+        {
+            break;
+        }
+    }
+    if (!found)
+    {
+        return -1;
+    }
+
+    for (StateCode state = endState; state != startState; )
+    {
+        int owner = Owner(state, size);
+        Move move = UnpackMove(comm.Broadcast(owner == rank ? parentMoves[state] : 0, owner));
+        moves.push_back(move);
+        state = UndoMove(state, numDisks, move);
+    }
+    std::reverse(moves.begin(), moves.end());
+    return moves.size();
+}
+
+//==============================================================================
+//
+// Distributed Search Solve
+//
+//==============================================================================
+int DistributedSearch::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    if (communicator)
+    {
+        return RunNode(*communicator, numDisks, numPegs, startState, endState, moves);
+    }
+
+    LocalNetwork network(numNodes);
+    std::vector<LocalCommunicator *> nodes;
+    std::vector<std::vector<Move> > nodeMoves(numNodes);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numNodes; i++)
+    {
+        nodes.push_back(new LocalCommunicator(network, i));
+    }
+    for (int i = 1; i < numNodes; i++)
+    {
+        threads.push_back(std::thread(&DistributedSearch::RunNode, this, std::ref(*nodes[i]),
+                numDisks, numPegs, startState, endState, std::ref(nodeMoves[i])));
+    }
+    int numMoves = RunNode(*nodes[0], numDisks, numPegs, startState, endState, moves);
+    for (size_t i = 0; i < threads.size(); i++)
+    {
+        threads[i].join();
+    }
+    for (int i = 0; i < numNodes; i++)
+    {
+        delete nodes[i];
+    }
+    return numMoves;
+}
+
+//==============================================================================
+//
+// Class declaration for the precomputed distance table
+//
+// A distance table holds, for every state of one (N, K) puzzle size, the
+// number of moves needed to reach the canonical target with all disks on the
+// first peg. Any other "all on one peg" target is the same problem with two
+// peg labels swapped. On disk the table is a DistanceTableHeader followed by
+// one byte per state, indexed by state rank, and it is used straight out of
+// an mmap of the file.
+//
+//==============================================================================
+typedef struct DistanceTableHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t numDisks;
+    uint32_t numPegs;
+    uint32_t reserved;
+    uint64_t numStates;
+} DistanceTableHeader;
+
+#define DISTANCE_TABLE_MAGIC "FBHDIST"
+#define DISTANCE_TABLE_VERSION 1
+
+class DistanceTable
+{
+public:
+    DistanceTable() : numDisks(0), numPegs(0), mapping(NULL), mappingSize(0), distances(NULL) { }
+
+    ~DistanceTable() { Unload(); }
+
+    static bool Build(int numDisks, int numPegs, const char *fileName);
+    bool Load(const char *fileName);
+    void Unload(void);
+    bool IsLoaded(void) { return distances != NULL; }
+    int Solve(StateCode startState, StateCode endState, std::vector<Move>& moves);
+    static StateCode SwapPegs(StateCode state, int numDisks, int peg1, int peg2);
+
+    int numDisks;
+    int numPegs;
+
+private:
+
+    void *mapping;
+    size_t mappingSize;
+    const uint8_t *distances;
+};
+
+//==============================================================================
+//
+// Compute Distances
+//
+// Run a BFS over the entire state space outward from the canonical target
+// (all disks on the first peg), filling in the distance of every state by
+// rank. Distances are kept in a byte, which is enough for the table sizes.
+//
+//==============================================================================
+static void ComputeDistances(int numDisks, int numPegs, std::vector<uint8_t>& distances)
+{
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks; i++)
+    {
+        numStates *= numPegs;
+    }
+
+    distances.assign(numStates, 0);
+    std::vector<bool> visited(numStates, false);
+    std::vector<StateCode> bfsQueue;
+    bfsQueue.reserve(numStates);
+
+    // all disks on the first peg is the zero state
+    bfsQueue.push_back(0);
+    visited[0] = true;
+    // expand the queue a batch at a time, taking fewer states only when
+    // fewer have been queued so far
+    for (size_t head = 0; head < bfsQueue.size(); )
+    {
+        int numCurrent = std::min((size_t)EXPAND_BATCH_STATES, bfsQueue.size() - head);
+        int curDistances[EXPAND_BATCH_STATES];
+        for (int i = 0; i < numCurrent; i++)
+        {
+            curDistances[i] = distances[RankState(bfsQueue[head+i], numDisks, numPegs)];
+        }
+
+        StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+        Move moves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+        int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+        int numMoves = ExpandStates(&bfsQueue[head], numCurrent, numDisks, numPegs,
+                newStates, moves, parents);
+        for (int i = 0; i < numMoves; i++)
+        {
+            StateRank rank = RankState(newStates[i], numDisks, numPegs);
+            if (!visited[rank])
+            {
+                visited[rank] = true;
+                distances[rank] = curDistances[parents[i]]+1;
+                bfsQueue.push_back(newStates[i]);
+            }
+        }
+        head += numCurrent;
+    }
+}
+
+//==============================================================================
+//
+// Distance Table Build
+//
+// compute the distance of every state and write them to fileName
+//
+//==============================================================================
+bool DistanceTable::Build(int numDisks, int numPegs, const char *fileName)
+{
+    std::vector<uint8_t> distances;
+    ComputeDistances(numDisks, numPegs, distances);
+    StateRank numStates = distances.size();
+
+    FILE *file = fopen(fileName, "wb");
+    if (!file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+
+    DistanceTableHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, DISTANCE_TABLE_MAGIC, sizeof(header.magic));
+    header.version = DISTANCE_TABLE_VERSION;
+    header.numDisks = numDisks;
+    header.numPegs = numPegs;
+    header.numStates = numStates;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(&distances[0], 1, numStates, file) == numStates;
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        std::cerr << "failed writing " << fileName << std::endl;
+    }
+    return ok;
+}
+
+//==============================================================================
+//
+// Distance Table Load
+//
+// Memory-map a table file written by Build and check its header.
+//
+//==============================================================================
+bool DistanceTable::Load(const char *fileName)
+{
+    Unload();
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat fileInfo;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &fileInfo) == 0 && fileInfo.st_size >= (off_t)sizeof(DistanceTableHeader))
+    {
+        data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const DistanceTableHeader *header = (const DistanceTableHeader *)data;
+    StateRank numStates = 1;
+    for (uint32_t i = 0; i < header->numDisks && i <= MAX_TABLE_DISKS; i++)
+    {
+        numStates *= header->numPegs;
+    }
+
+    if (strncmp(header->magic, DISTANCE_TABLE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != DISTANCE_TABLE_VERSION ||
+            header->numDisks > MAX_TABLE_DISKS || header->numPegs > MAX_TABLE_PEGS ||
+            header->numStates != numStates ||
+            (size_t)fileInfo.st_size < sizeof(DistanceTableHeader) + numStates)
+    {
+        std::cerr << "invalid distance table " << fileName << std::endl;
+        munmap(data, fileInfo.st_size);
+        return false;
+    }
+
+    mapping = data;
+    mappingSize = fileInfo.st_size;
+    distances = (const uint8_t *)(header+1);
+    numDisks = header->numDisks;
+    numPegs = header->numPegs;
+    return true;
+}
+
+//==============================================================================
+//
+// Distance Table Unload
+//
+//==============================================================================
+void DistanceTable::Unload(void)
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+    mapping = NULL;
+    mappingSize = 0;
+    distances = NULL;
+}
+
+//==============================================================================
+//
+// Swap Pegs
+//
+// relabel a state by exchanging two pegs
+//
+//==============================================================================
+StateCode DistanceTable::SwapPegs(StateCode state, int numDisks, int peg1, int peg2)
+{
+    for (int i = 0; i < numDisks; i++)
+    {
+        int peg = StateCodec::GetPeg(state, i);
+        if (peg == peg1)
+        {
+            state = StateCodec::SetPeg(state, i, peg2);
+        }
+        else if (peg == peg2)
+        {
+            state = StateCodec::SetPeg(state, i, peg1);
+        }
+    }
+    return state;
+}
+
+//==============================================================================
+//
+// Distance Table Solve
+//
+// Answer a query with no search at all: starting from startState, repeatedly
+// take any move to a neighbor whose table distance is one less. Only works
+// when endState has every disk on one peg; returns -1 for any other target
+// so the caller can fall back to searching.
+//
+//==============================================================================
+int DistanceTable::Solve(StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    moves.clear();
+
+    int targetPeg = StateCodec::GetPeg(endState, 0);
+    for (int i = 1; i < numDisks; i++)
+    {
+        if (StateCodec::GetPeg(endState, i) != targetPeg)
+        {
+            return -1;
+        }
+    }
+
+    StateCode curState = startState;
+    int distance = distances[RankState(SwapPegs(curState, numDisks, 0, targetPeg), numDisks, numPegs)];
+    for (int remaining = distance; remaining > 0; remaining--)
+    {
+        StateCode newStates[MAX_MOVES_PER_STATE];
+        Move newMoves[MAX_MOVES_PER_STATE];
+        int numMoves = GenerateMoves(curState, numDisks, numPegs, newStates, newMoves);
+        int i;
+        for (i = 0; i < numMoves; i++)
+        {
+            StateCode canonical = SwapPegs(newStates[i], numDisks, 0, targetPeg);
+            if (distances[RankState(canonical, numDisks, numPegs)] == remaining-1)
+            {
+                break;
+            }
+        }
+
+        if (i == numMoves)
+        {
+            // only possible with a corrupt table
+            moves.clear();
+            return -1;
+        }
+        curState = newStates[i];
+        moves.push_back(newMoves[i]);
+    }
+    return distance;
+}
+
+//==============================================================================
+//
+// Class declaration for the pattern database
+//
+// A pattern database holds, for every state of an M disk puzzle with K pegs,
+// a lower bound on the moves needed to gather all disks on the first peg.
+// Removing disks from a puzzle only removes constraints, so the entry for the
+// pattern formed by any M disks of a bigger puzzle bounds the moves those
+// disks must make, and patterns over disjoint sets of disks can be added.
+//
+// Entries take four bits, two states to a byte (even ranks in the low
+// nibble). Distances beyond PATTERN_DATABASE_MAX_DISTANCE are stored as that
+// value, which keeps every entry a lower bound. The file is a
+// DistanceTableHeader followed by the packed entries, used by mmap.
+//
+//==============================================================================
+#define PATTERN_DATABASE_MAGIC "FBHPDB"
+#define PATTERN_DATABASE_VERSION 1
+#define PATTERN_DATABASE_MAX_DISTANCE 15
+
+class PatternDatabase
+{
+public:
+    PatternDatabase() : numDisks(0), numPegs(0), mapping(NULL), mappingSize(0), entries(NULL) { }
+
+    ~PatternDatabase() { Unload(); }
+
+    static bool Build(int numDisks, int numPegs, const char *fileName);
+    bool Load(const char *fileName);
+    void Unload(void);
+    bool IsLoaded(void) { return entries != NULL; }
+
+    int Lookup(StateRank rank)
+    {
+        return (entries[rank / 2] >> ((rank % 2) * 4)) & 0xf;
+    }
+
+    int numDisks;
+    int numPegs;
+
+private:
+    static StateRank NumStates(int numDisks, int numPegs);
+
+    void *mapping;
+    size_t mappingSize;
+    const uint8_t *entries;
+};
+
+StateRank PatternDatabase::NumStates(int numDisks, int numPegs)
+{
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks; i++)
+    {
+        numStates *= numPegs;
+    }
+    return numStates;
+}
+
+//==============================================================================
+//
+// Pattern Database Build
+//
+// The goal is a single state, so every distance to it comes out of one
+// retrograde BFS from all disks on the first peg (moves are reversible, so
+// this is an ordinary BFS outward from the goal), the same pass that builds
+// a distance table. The distances are then packed and written to fileName.
+//
+//==============================================================================
+bool PatternDatabase::Build(int numDisks, int numPegs, const char *fileName)
+{
+    std::vector<uint8_t> distances;
+    ComputeDistances(numDisks, numPegs, distances);
+
+    StateRank numStates = distances.size();
+    std::vector<uint8_t> packed((numStates + 1) / 2, 0);
+    for (StateRank rank = 0; rank < numStates; rank++)
+    {
+        int distance = std::min((int)distances[rank], PATTERN_DATABASE_MAX_DISTANCE);
+        packed[rank / 2] |= distance << ((rank % 2) * 4);
+    }
+
+    FILE *file = fopen(fileName, "wb");
+    if (!file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+
+    DistanceTableHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, PATTERN_DATABASE_MAGIC, sizeof(header.magic));
+    header.version = PATTERN_DATABASE_VERSION;
+    header.numDisks = numDisks;
+    header.numPegs = numPegs;
+    header.numStates = numStates;
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        fwrite(&packed[0], 1, packed.size(), file) == packed.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok)
+    {
+        std::cerr << "failed writing " << fileName << std::endl;
+    }
+    return ok;
+}
+
+//==============================================================================
+//
+// Pattern Database Load
+//
+// Memory-map a database file written by Build and check its header.
+//
+//==============================================================================
+bool PatternDatabase::Load(const char *fileName)
+{
+    Unload();
+
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat fileInfo;
+    void *data = MAP_FAILED;
+    if (fstat(fd, &fileInfo) == 0 && fileInfo.st_size >= (off_t)sizeof(DistanceTableHeader))
+    {
+        data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const DistanceTableHeader *header = (const DistanceTableHeader *)data;
+    bool sizeOk = header->numDisks <= MAX_PATTERN_DISKS && header->numPegs <= StateCodec::kMaxPegs;
+    StateRank numStates = sizeOk ? NumStates(header->numDisks, header->numPegs) : 0;
+    if (strncmp(header->magic, PATTERN_DATABASE_MAGIC, sizeof(header->magic)) != 0 ||
+            header->version != PATTERN_DATABASE_VERSION || !sizeOk ||
+            header->numStates != numStates ||
+            (size_t)fileInfo.st_size < sizeof(DistanceTableHeader) + (numStates + 1) / 2)
+    {
+        std::cerr << "invalid pattern database " << fileName << std::endl;
+        munmap(data, fileInfo.st_size);
+        return false;
+    }
+
+    mapping = data;
+    mappingSize = fileInfo.st_size;
+    entries = (const uint8_t *)(header+1);
+    numDisks = header->numDisks;
+    numPegs = header->numPegs;
+    return true;
+}
+
+//==============================================================================
+//
+// Pattern Database Unload
+//
+//==============================================================================
+void PatternDatabase::Unload(void)
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+    mapping = NULL;
+    mappingSize = 0;
+    entries = NULL;
+}
+
+//==============================================================================
+//
+// Pattern Databases
+//
+// One database per pattern size M and peg count K, stored in a directory as
+// hanoi-M-K.pdb. --build-pdb writes every size up to MAX_PATTERN_DISKS;
+// --pdb maps whatever is present.
+//
+//==============================================================================
+static PatternDatabase patternDatabases[MAX_PATTERN_DISKS+1][StateCodec::kMaxPegs+1];
+
+static std::string PatternDatabaseFile(const char *dir, int numDisks, int numPegs)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/hanoi-%d-%d.pdb", numDisks, numPegs);
+    return std::string(dir) + name;
+}
+
+bool BuildPatternDatabases(const char *dir)
+{
+    for (int numDisks = 1; numDisks <= MAX_PATTERN_DISKS; numDisks++)
+    {
+        for (int numPegs = MIN_PEGS; numPegs <= StateCodec::kMaxPegs; numPegs++)
+        {
+            std::string fileName = PatternDatabaseFile(dir, numDisks, numPegs);
+            if (!PatternDatabase::Build(numDisks, numPegs, fileName.c_str()))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void LoadPatternDatabases(const char *dir)
+{
+    for (int numDisks = 1; numDisks <= MAX_PATTERN_DISKS; numDisks++)
+    {
+        for (int numPegs = MIN_PEGS; numPegs <= StateCodec::kMaxPegs; numPegs++)
+        {
+            std::string fileName = PatternDatabaseFile(dir, numDisks, numPegs);
+            PatternDatabase& database = patternDatabases[numDisks][numPegs];
+            if (database.Load(fileName.c_str()) &&
+                    (database.numDisks != numDisks || database.numPegs != numPegs))
+            {
+                std::cerr << fileName << " holds the wrong puzzle size" << std::endl;
+                database.Unload();
+            }
+        }
+    }
+}
+
+static PatternDatabase *GetPatternDatabase(int numDisks, int numPegs)
+{
+    if (numDisks > MAX_PATTERN_DISKS || numPegs < MIN_PEGS || numPegs > StateCodec::kMaxPegs)
+    {
+        return NULL;
+    }
+    PatternDatabase *database = &patternDatabases[numDisks][numPegs];
+    return database->IsLoaded() ? database : NULL;
+}
+
+//==============================================================================
+//
+// Class declaration for the pattern database heuristic
+//
+// Splits the disks into disjoint groups of up to groupDisks consecutive
+// disks, smallest first, and adds up one bound per group: the pattern
+// database entry when the group's disks all end on one peg and a database of
+// its size is loaded, or else the number of the group's disks off their
+// target pegs. The result is never below the misplaced disk estimate, which
+// is also admissible, since the larger of the two is used.
+//
+//==============================================================================
+class PatternDatabaseHeuristic : public Heuristic
+{
+public:
+    PatternDatabaseHeuristic(int groupDisks) : groupDisks(groupDisks), numGroups(0) { }
+
+    void SetGoal(int numDisks, int numPegs, StateCode endState);
+    int Estimate(StateCode state);
+
+private:
+    typedef struct DiskGroup
+    {
+        int firstDisk;
+        int numDisks;
+        int targetPeg;
+        PatternDatabase *database;
+    } DiskGroup;
+
+    int groupDisks;
+    int numPegs;
+    StateCode endState;
+    int numGroups;
+    DiskGroup groups[StateCodec::kMaxDisks];
+    MisplacedDiskHeuristic misplaced;
+};
+
+void PatternDatabaseHeuristic::SetGoal(int numDisks, int numPegs, StateCode endState)
+{
+    this->numPegs = numPegs;
+    this->endState = endState;
+    misplaced.SetGoal(numDisks, numPegs, endState);
+
+    numGroups = 0;
+    for (int first = 0; first < numDisks; first += groupDisks)
+    {
+        DiskGroup& group = groups[numGroups++];
+        group.firstDisk = first;
+        group.numDisks = std::min(groupDisks, numDisks - first);
+        group.targetPeg = StateCodec::GetPeg(endState, first);
+        for (int disk = first+1; disk < first + group.numDisks; disk++)
+        {
+            if ((int)StateCodec::GetPeg(endState, disk) != group.targetPeg)
+            {
+                group.targetPeg = -1;
+            }
+        }
+        group.database = GetPatternDatabase(group.numDisks, numPegs);
+    }
+}
+
+int PatternDatabaseHeuristic::Estimate(StateCode state)
+{
+    int estimate = 0;
+    for (int i = 0; i < numGroups; i++)
+    {
+        const DiskGroup& group = groups[i];
+        if (group.database && group.targetPeg >= 0)
+        {
+            // the group's disks on their own form a smaller puzzle
+            StateCode mask = ((StateCode)1 << (StateCodec::kBitsPerDisk * group.numDisks)) - 1;
+            StateCode pattern = (state >> (StateCodec::kBitsPerDisk * group.firstDisk)) & mask;
+            pattern = DistanceTable::SwapPegs(pattern, group.numDisks, 0, group.targetPeg);
+            estimate += group.database->Lookup(RankState(pattern, group.numDisks, numPegs));
+        }
+        else
+        {
+            for (int disk = group.firstDisk; disk < group.firstDisk + group.numDisks; disk++)
+            {
+                estimate += StateCodec::GetPeg(state, disk) != StateCodec::GetPeg(endState, disk);
+            }
+        }
+    }
+    return std::max(estimate, misplaced.Estimate(state));
+}
+
+//==============================================================================
+//
+// Class declaration for the solution cache
+//
+// An LRU cache of solved puzzles keyed by (N, K, start, end), holding the
+// move list that the search produced. Entries live in a list ordered from
+// most to least recently used, with a hash map from key to list position.
+// The cache can also be saved to and reloaded from a text file with one
+// "N K start end M from to from to ..." line per entry (states as packed
+// codes, pegs zero based), so repeated puzzles survive across processes.
+//
+//==============================================================================
+class SolutionCache
+{
+public:
+    typedef struct Key
+    {
+        int numDisks;
+        int numPegs;
+        StateCode startState;
+        StateCode endState;
+
+        bool operator==(const Key& other) const
+        {
+            return numDisks == other.numDisks && numPegs == other.numPegs &&
+                startState == other.startState && endState == other.endState;
+        }
+    } Key;
+
+    SolutionCache(size_t capacity) : capacity(capacity), hits(0), misses(0) { }
+
+    bool Lookup(const Key& key, std::vector<Move>& moves);
+    void Insert(const Key& key, const std::vector<Move>& moves);
+    void Merge(const SolutionCache& other);
+    bool Load(const char *fileName);
+    bool Save(const char *fileName);
+
+    size_t capacity;
+    size_t hits;
+    size_t misses;
+
+private:
+    typedef struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            uint64_t h = ((uint64_t)key.startState * 0x9E3779B97F4A7C15ull) ^ key.endState;
+            h ^= ((uint64_t)key.numDisks << 8 | key.numPegs) * 0xC2B2AE3D27D4EB4Full;
+            return (size_t)(h ^ (h >> 29));
+        }
+    } KeyHash;
+
+    typedef std::pair<Key, std::vector<Move> > Entry;
+
+    std::list<Entry> entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+};
+
+//==============================================================================
+//
+// Solution Cache Lookup
+//
+// fetch a cached solution, marking it most recently used
+//
+//==============================================================================
+bool SolutionCache::Lookup(const Key& key, std::vector<Move>& moves)
+{
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash>::iterator iter = index.find(key);
+    if (iter == index.end())
+    {
+        misses++;
+        return false;
+    }
+
+    hits++;
+    entries.splice(entries.begin(), entries, iter->second);
+    moves = iter->second->second;
+    return true;
+}
+
+//==============================================================================
+//
+// Solution Cache Insert
+//
+// remember a solution, evicting the least recently used one if full
+//
+//==============================================================================
+void SolutionCache::Insert(const Key& key, const std::vector<Move>& moves)
+{
+    if (capacity == 0)
+    {
+        return;
+    }
+
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash>::iterator iter = index.find(key);
+    if (iter != index.end())
+    {
+        iter->second->second = moves;
+        entries.splice(entries.begin(), entries, iter->second);
+        return;
+    }
+
+    if (entries.size() >= capacity)
+    {
+        index.erase(entries.back().first);
+        entries.pop_back();
+    }
+    entries.push_front(Entry(key, moves));
+    index[key] = entries.begin();
+}
+
+//==============================================================================
+//
+// Solution Cache Merge
+//
+// insert every entry of another cache, keeping its recency order
+//
+//==============================================================================
+void SolutionCache::Merge(const SolutionCache& other)
+{
+    std::list<Entry>::const_reverse_iterator iter;
+    for (iter = other.entries.rbegin(); iter != other.entries.rend(); iter++)
+    {
+        Insert(iter->first, iter->second);
+    }
+    hits += other.hits;
+    misses += other.misses;
+}
+
+//==============================================================================
+//
+// Check Cache Entry
+//
+// A loaded entry is only trusted if its size is one the solver accepts and
+// its moves, played from startState, are all legal, never return to a state
+// they already passed through (which no minimal path does) and end at
+// endState. Beyond that an entry is trusted to be minimal: proving it would
+// take a search per entry, which is what the cache is there to avoid.
+//
+//==============================================================================
+static bool CheckCacheEntry(const SolutionCache::Key& key, const std::vector<Move>& moves)
+{
+    if (key.numDisks < 1 || key.numDisks > StateCodec::kMaxDisks ||
+        key.numPegs < MIN_PEGS || key.numPegs > StateCodec::kMaxPegs)
+    {
+        return false;
+    }
+    for (int i = 0; i < key.numDisks; i++)
+    {
+        if (StateCodec::GetPeg(key.startState, i) >= key.numPegs ||
+            StateCodec::GetPeg(key.endState, i) >= key.numPegs)
+        {
+            return false;
+        }
+    }
+    int shift = key.numDisks * StateCodec::kBitsPerDisk;
+    if ((key.startState >> shift) != 0 || (key.endState >> shift) != 0)
+    {
+        return false;
+    }
+
+    StateCode state = key.startState;
+    std::vector<StateCode> path(1, state);
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        int fromPeg = moves[i].fromPeg;
+        int toPeg = moves[i].toPeg;
+        if (fromPeg >= key.numPegs || toPeg >= key.numPegs || fromPeg == toPeg)
+        {
+            return false;
+        }
+
+        // the smallest disk on fromPeg moves, and no smaller one may be on toPeg
+        int disk = 0;
+        while (disk < key.numDisks && StateCodec::GetPeg(state, disk) != fromPeg)
+        {
+            if (StateCodec::GetPeg(state, disk) == toPeg)
+            {
+                return false;
+            }
+            disk++;
+        }
+        if (disk == key.numDisks)
+        {
+            return false;
+        }
+        state = StateCodec::SetPeg(state, disk, toPeg);
+        path.push_back(state);
+    }
+    if (state != key.endState)
+    {
+        return false;
+    }
+
+    std::sort(path.begin(), path.end());
+    return std::adjacent_find(path.begin(), path.end()) == path.end();
+}
+
+//==============================================================================
+//
+// Solution Cache Load
+//
+// Read entries saved by Save. A missing file is not an error, it just means
+// there is nothing cached yet. A file that does not parse is ignored as a
+// whole; entries that parse but fail CheckCacheEntry are skipped.
+//
+//==============================================================================
+bool SolutionCache::Load(const char *fileName)
+{
+    FILE *file = fopen(fileName, "r");
+    if (!file)
+    {
+        return true;
+    }
+
+    // the file lists the most recently used entry first, so insert in
+    // reverse to reproduce the same order
+    std::vector<Entry> loaded;
+    unsigned long long startState, endState;
+    Key key;
+    int numMoves;
+    size_t numSkipped = 0;
+    bool ok = true;
+    while (fscanf(file, "%d %d %llu %llu %d", &key.numDisks, &key.numPegs,
+                &startState, &endState, &numMoves) == 5)
+    {
+        key.startState = (StateCode)startState;
+        key.endState = (StateCode)endState;
+
+        // read the moves one at a time (the count may be wrong), noting any
+        // peg that does not fit a Move
+        std::vector<Move> moves;
+        bool valid = (unsigned long long)key.startState == startState &&
+            (unsigned long long)key.endState == endState;
+        for (int i = 0; i < numMoves && ok; i++)
+        {
+            int fromPeg, toPeg;
+            ok = fscanf(file, "%d %d", &fromPeg, &toPeg) == 2;
+            if (!ok)
+            {
+                break;
+            }
+            if (fromPeg < 0 || fromPeg >= StateCodec::kMaxPegs ||
+                toPeg < 0 || toPeg >= StateCodec::kMaxPegs)
+            {
+                valid = false;
+            }
+            Move move;
+            move.fromPeg = fromPeg;
+            move.toPeg = toPeg;
+            moves.push_back(move);
+        }
+        if (!ok || numMoves < 0)
+        {
+            ok = false;
+            break;
+        }
+        if (valid && CheckCacheEntry(key, moves))
+        {
+            loaded.push_back(Entry(key, moves));
+        }
+        else
+        {
+            numSkipped++;
+        }
+    }
+    ok = ok && feof(file);
+    fclose(file);
+
+    if (!ok)
+    {
+        std::cerr << "ignoring malformed solution cache " << fileName << std::endl;
+        return false;
+    }
+    if (numSkipped > 0)
+    {
+        std::cerr << "skipped " << numSkipped << " invalid entries in solution cache "
+                  << fileName << std::endl;
+    }
+
+    for (size_t i = loaded.size(); i > 0; i--)
+    {
+        Insert(loaded[i-1].first, loaded[i-1].second);
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Solution Cache Save
+//
+// write every entry, most recently used first
+//
+//==============================================================================
+bool SolutionCache::Save(const char *fileName)
+{
+    FILE *file = fopen(fileName, "w");
+    if (!file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+
+    std::list<Entry>::iterator iter;
+    for (iter = entries.begin(); iter != entries.end(); iter++)
+    {
+        const Key& key = iter->first;
+        const std::vector<Move>& moves = iter->second;
+        fprintf(file, "%d %d %llu %llu %d", key.numDisks, key.numPegs,
+                (unsigned long long)key.startState, (unsigned long long)key.endState,
+                (int)moves.size());
+        for (size_t i = 0; i < moves.size(); i++)
+        {
+            fprintf(file, " %d %d", moves[i].fromPeg, moves[i].toPeg);
+        }
+        fprintf(file, "\n");
+    }
+
+    if (fclose(file) != 0)
+    {
+        std::cerr << "failed writing " << fileName << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Distance Tables
+//
+// One table per supported (N, K), stored in a directory as hanoi-N-K.dist.
+// --build-tables writes the whole set; --tables maps whatever is present.
+//
+//==============================================================================
+static DistanceTable distanceTables[MAX_TABLE_DISKS+1][MAX_TABLE_PEGS+1];
+
+static std::string DistanceTableFile(const char *dir, int numDisks, int numPegs)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/hanoi-%d-%d.dist", numDisks, numPegs);
+    return std::string(dir) + name;
+}
+
+bool BuildDistanceTables(const char *dir)
+{
+    for (int numDisks = 1; numDisks <= MAX_TABLE_DISKS; numDisks++)
+    {
+        for (int numPegs = MIN_TABLE_PEGS; numPegs <= MAX_TABLE_PEGS; numPegs++)
+        {
+            std::string fileName = DistanceTableFile(dir, numDisks, numPegs);
+            if (!DistanceTable::Build(numDisks, numPegs, fileName.c_str()))
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void LoadDistanceTables(const char *dir)
+{
+    for (int numDisks = 1; numDisks <= MAX_TABLE_DISKS; numDisks++)
+    {
+        for (int numPegs = MIN_TABLE_PEGS; numPegs <= MAX_TABLE_PEGS; numPegs++)
+        {
+            std::string fileName = DistanceTableFile(dir, numDisks, numPegs);
+            DistanceTable& table = distanceTables[numDisks][numPegs];
+            if (table.Load(fileName.c_str()) &&
+                    (table.numDisks != numDisks || table.numPegs != numPegs))
+            {
+                std::cerr << fileName << " holds the wrong puzzle size" << std::endl;
+                table.Unload();
+            }
+        }
+    }
+}
+
+static DistanceTable *GetDistanceTable(int numDisks, int numPegs)
+{
+    if (numDisks > MAX_TABLE_DISKS || numPegs < MIN_TABLE_PEGS || numPegs > MAX_TABLE_PEGS)
+    {
+        return NULL;
+    }
+    DistanceTable *table = &distanceTables[numDisks][numPegs];
+    return table->IsLoaded() ? table : NULL;
+}
+
+//==============================================================================
+//
+// Dump Graph
+//
+// Write the explored graph in CSR form: a "vertices edges" header line, the
+// row offsets on the next line and the edge targets on the last.
+//
+//==============================================================================
+static bool DumpGraph(Graph *graph, const char *fileName)
+{
+    FILE *file = fopen(fileName, "w");
+    if (!file)
+    {
+        std::cerr << "cannot open " << fileName << std::endl;
+        return false;
+    }
+
+    std::vector<int> offsets;
+    std::vector<int> targets;
+    graph->ExportAdjacency(offsets, targets);
+
+    fprintf(file, "%d %d\n", (int)offsets.size()-1, (int)targets.size());
+    for (size_t i = 0; i < offsets.size(); i++)
+    {
+        fprintf(file, i ? " %d" : "%d", offsets[i]);
+    }
+    fprintf(file, "\n");
+    for (size_t i = 0; i < targets.size(); i++)
+    {
+        fprintf(file, i ? " %d" : "%d", targets[i]);
+    }
+    fprintf(file, "\n");
+    fclose(file);
+    return true;
+}
+
+//==============================================================================
+//
+// Explore All Distances
+//
+// Run a BFS from startState until every reachable state has been seen,
+// streaming one "distance size cumulative" line per layer as it completes
+// and finally the eccentricity of startState (the largest distance). Like
+// the lean search it keeps only a visited bit per state and the current and
+// next layers.
+//
+// With distanceFile set, the distance of every state is also written there,
+// one byte per state indexed by rank behind a DistanceTableHeader (magic
+// DISTANCE_FILE_MAGIC). The file is memory-mapped and filled in as states
+// are discovered; distances of 255 or more are stored as 255.
+//
+//==============================================================================
+#define DISTANCE_FILE_MAGIC "FBHFROM"
+#define DISTANCE_FILE_VERSION 1
+
+bool ExploreAllDistances(int numDisks, int numPegs, StateCode startState,
+        const char *distanceFile, FILE *output)
+{
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks && numStates <= MAX_LEAN_SEARCH_STATES; i++)
+    {
+        numStates *= numPegs;
+    }
+    if (numStates > MAX_LEAN_SEARCH_STATES)
+    {
+        std::cerr << "state space too large to explore exhaustively" << std::endl;
+        return false;
+    }
+
+    uint8_t *distances = NULL;
+    void *mapping = MAP_FAILED;
+    size_t mappingSize = sizeof(DistanceTableHeader) + numStates;
+    if (distanceFile)
+    {
+        int fd = open(distanceFile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd >= 0 && ftruncate(fd, mappingSize) == 0)
+        {
+            mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        if (mapping == MAP_FAILED)
+        {
+            std::cerr << "cannot create " << distanceFile << std::endl;
+            return false;
+        }
+
+        DistanceTableHeader header;
+        memset(&header, 0, sizeof(header));
+        strncpy(header.magic, DISTANCE_FILE_MAGIC, sizeof(header.magic));
+        header.version = DISTANCE_FILE_VERSION;
+        header.numDisks = numDisks;
+        header.numPegs = numPegs;
+        header.numStates = numStates;
+        memcpy(mapping, &header, sizeof(header));
+        distances = (uint8_t *)mapping + sizeof(header);
+    }
+
+    std::vector<uint64_t> visited((numStates + 63) / 64, 0);
+    StateRank startRank = RankState(startState, numDisks, numPegs);
+    visited[startRank / 64] |= 1ull << (startRank % 64);
+    std::vector<StateCode> frontier(1, startState);
+    std::vector<StateCode> nextFrontier;
+
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move newMoves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    uint64_t numReached = 0;
+    int distance = 0;
+    char line[96];
+    for (;;)
+    {
+        numReached += frontier.size();
+        snprintf(line, sizeof(line), "%d %llu %llu\n", distance,
+                (unsigned long long)frontier.size(), (unsigned long long)numReached);
+        fputs(line, output);
+        fflush(output);
+
+        nextFrontier.clear();
+        uint8_t nextDistance = std::min(distance+1, 255);
+        for (size_t first = 0; first < frontier.size(); first += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = std::min((size_t)EXPAND_BATCH_STATES, frontier.size() - first);
+            int numMoves = ExpandStates(&frontier[first], numCurrent, numDisks, numPegs,
+                    newStates, newMoves, parents);
+            for (int i = 0; i < numMoves; i++)
+            {
+                StateRank rank = RankState(newStates[i], numDisks, numPegs);
+                uint64_t bit = 1ull << (rank % 64);
+                if (!(visited[rank / 64] & bit))
+                {
+                    visited[rank / 64] |= bit;
+                    if (distances)
+                    {
+                        distances[rank] = nextDistance;
+                    }
+                    nextFrontier.push_back(newStates[i]);
+                }
+            }
+        }
+        if (nextFrontier.empty())
+        {
+            break;
+        }
+        frontier.swap(nextFrontier);
+        distance++;
+    }
+
+    snprintf(line, sizeof(line), "max distance = %d, states reached = %llu of %llu\n",
+            distance, (unsigned long long)numReached, (unsigned long long)numStates);
+    fputs(line, output);
+
+    bool ok = fflush(output) == 0;
+    if (distances)
+    {
+        bool synced = msync(mapping, mappingSize, MS_SYNC) == 0;
+        munmap(mapping, mappingSize);
+        ok = ok && synced;
+        if (!synced)
+        {
+            std::cerr << "failed writing " << distanceFile << std::endl;
+        }
+    }
+    return ok;
+}
+
+//==============================================================================
+//
+// Class declaration for the Frame-Stewart solver
+//
+// When every disk starts on one peg and must end on another, the answer
+// follows from the Frame-Stewart recursion with no search: park the smallest
+// k disks on a spare peg using all K pegs, move the other N-k to the target
+// with the K-1 pegs left, then bring the k disks over on top, choosing k to
+// minimize the total. With three pegs this is the classic recursion. It is
+// proven minimal for three and four pegs, so only those are answered here.
+//
+//==============================================================================
+class FrameStewart
+{
+public:
+    FrameStewart();
+
+    int Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+            std::vector<Move>& moves);
+
+private:
+    void Generate(int numDisks, int numPegs, int fromPeg, int toPeg, uint32_t pegMask,
+            std::vector<Move>& moves);
+
+    // moves needed and best split for n disks using p pegs
+    uint64_t numMoves[MAX_CLOSED_FORM_PEGS+1][StateCodec::kMaxDisks+1];
+    int split[MAX_CLOSED_FORM_PEGS+1][StateCodec::kMaxDisks+1];
+};
+
+//==============================================================================
+//
+// Frame-Stewart Constructor
+//
+// Tabulate the recursion. Two pegs can only move a single disk; every
+// larger count is marked unreachable so it never wins a minimization.
+//
+//==============================================================================
+FrameStewart::FrameStewart()
+{
+    const uint64_t unreachable = UINT64_MAX / 4;
+    for (int numPegs = 2; numPegs <= MAX_CLOSED_FORM_PEGS; numPegs++)
+    {
+        numMoves[numPegs][0] = 0;
+        numMoves[numPegs][1] = 1;
+        split[numPegs][0] = split[numPegs][1] = 0;
+        for (int n = 2; n <= StateCodec::kMaxDisks; n++)
+        {
+            numMoves[numPegs][n] = unreachable;
+            split[numPegs][n] = 0;
+            for (int k = 1; numPegs > 2 && k < n; k++)
+            {
+                uint64_t total = 2 * numMoves[numPegs][k] + numMoves[numPegs-1][n-k];
+                if (total < numMoves[numPegs][n])
+                {
+                    numMoves[numPegs][n] = total;
+                    split[numPegs][n] = k;
+                }
+            }
+        }
+    }
+}
+
+//==============================================================================
+//
+// Frame-Stewart Generate
+//
+// Append the moves taking the top numDisks disks from fromPeg to toPeg,
+// using only the numPegs pegs in pegMask.
+//
+//==============================================================================
+void FrameStewart::Generate(int numDisks, int numPegs, int fromPeg, int toPeg, uint32_t pegMask,
+        std::vector<Move>& moves)
+{
+    if (numDisks == 0)
+    {
+        return;
+    }
+    if (numDisks == 1)
+    {
+        Move move = { (uint8_t)fromPeg, (uint8_t)toPeg };
+        moves.push_back(move);
+        return;
+    }
+
+    int k = split[numPegs][numDisks];
+    int sparePeg = __builtin_ctz(pegMask & ~(1u << fromPeg) & ~(1u << toPeg));
+    Generate(k, numPegs, fromPeg, sparePeg, pegMask, moves);
+    Generate(numDisks-k, numPegs-1, fromPeg, toPeg, pegMask & ~(1u << sparePeg), moves);
+    Generate(k, numPegs, sparePeg, toPeg, pegMask, moves);
+}
+
+//==============================================================================
+//
+// Frame-Stewart Solve
+//
+// Returns -1 unless both states have all disks on one peg and the puzzle has
+// at most MAX_CLOSED_FORM_PEGS pegs, leaving the puzzle to the other solvers.
+//
+//==============================================================================
+int FrameStewart::Solve(int numDisks, int numPegs, StateCode startState, StateCode endState,
+        std::vector<Move>& moves)
+{
+    if (numPegs > MAX_CLOSED_FORM_PEGS)
+    {
+        return -1;
+    }
+
+    int fromPeg = StateCodec::GetPeg(startState, 0);
+    int toPeg = StateCodec::GetPeg(endState, 0);
+    for (int disk = 1; disk < numDisks; disk++)
+    {
+        if ((int)StateCodec::GetPeg(startState, disk) != fromPeg ||
+                (int)StateCodec::GetPeg(endState, disk) != toPeg)
+        {
+            return -1;
+        }
+    }
+
+    moves.clear();
+    if (fromPeg != toPeg)
+    {
+        moves.reserve(numMoves[numPegs][numDisks]);
+        Generate(numDisks, numPegs, fromPeg, toPeg, (1u << numPegs) - 1, moves);
+    }
+    return moves.size();
+}
+
+// set when this process is one node of a multi-process distributed search
+static Communicator *worldCommunicator = NULL;
+
+#ifdef FBHANOI_USE_MPI
+int JoinMpiWorld(int& rank)
+{
+    static MpiCommunicator mpiCommunicator;
+    rank = mpiCommunicator.Rank();
+    if (mpiCommunicator.Size() > 1)
+    {
+        worldCommunicator = &mpiCommunicator;
+    }
+    return mpiCommunicator.Size();
+}
+#endif
+
+//==============================================================================
+//
+// Solver Options Constructor
+//
+//==============================================================================
+SolverOptions::SolverOptions() :
+    algorithm(kSearchAlgorithm_Bfs), bidirectional(false), symmetry(false),
+    sortFrontier(false), maxMoves(-1), searchThreads(1),
+    cacheEntries(DEFAULT_CACHE_ENTRIES), usePatternDatabases(false),
+    patternDisks(DEFAULT_PATTERN_DISKS), workDir(DEFAULT_WORK_DIR),
+    numNodes(DEFAULT_DISTRIBUTED_NODES), collectTimes(false), memoryBudget(0)
+{
+}
+
+//==============================================================================
+//
+// Memory Estimates
+//
+// Rough peak bytes of a search that visits all K^N states, from the sizes of
+// the containers each engine keeps per state: the graph's vertex arrays and
+// frontiers plus its dense or hashed index, the lean search's visited bits,
+// parent moves and two frontiers (the parallel search keeps the same), and
+// the A* node map and open list. IDA* keeps only its path. Mapped tables and
+// pattern databases are not counted. Spaces too big for the lean search's
+// rank arrays come out as needing more than any budget.
+//
+//==============================================================================
+static double EstimateSearchBytes(SearchAlgorithm algorithm, int numDisks, int numPegs)
+{
+    double numStates = 1;
+    for (int i = 0; i < numDisks; i++)
+    {
+        numStates *= numPegs;
+    }
+
+    switch (algorithm)
+    {
+    case kSearchAlgorithm_Lean:
+        if (numStates > MAX_LEAN_SEARCH_STATES)
+        {
+            return 1e300;
+        }
+        return numStates * (1.0 / 8 + sizeof(PackedMove) + 2 * sizeof(StateCode));
+    case kSearchAlgorithm_AStar:
+        // hash node, bucket and open list entry
+        return numStates * (sizeof(StateCode) + 2 * sizeof(void *) + 16 + 12);
+    case kSearchAlgorithm_IdaStar:
+        return 0;
+    default:
+        break;
+    }
+
+    double vertexBytes = sizeof(StateCode) + 2 + 2 * sizeof(int) + sizeof(Move) + 2 * sizeof(int);
+    double indexBytes = numStates <= MAX_DENSE_INDEX_STATES ? sizeof(int) : 40;
+    return numStates * (vertexBytes + indexBytes);
+}
+
+static const char *AlgorithmName(SearchAlgorithm algorithm)
+{
+    switch (algorithm)
+    {
+    case kSearchAlgorithm_Lean:
+        return "lean";
+    case kSearchAlgorithm_External:
+        return "external";
+    case kSearchAlgorithm_Distributed:
+        return "distributed";
+    case kSearchAlgorithm_AStar:
+        return "astar";
+    case kSearchAlgorithm_IdaStar:
+        return "idastar";
+    default:
+        return "bfs";
+    }
+}
+
+//==============================================================================
+//
+// Solver Context
+//
+// Everything one solver owns and reuses from puzzle to puzzle.
+//
+//==============================================================================
+struct HanoiSolver::Context
+{
+    Context(const SolverOptions& options) :
+        options(options), graph(0, 0), cache(options.cacheEntries)
+    {
+        graph.useSymmetry = options.symmetry;
+        graph.sortFrontier = options.sortFrontier;
+        if (options.usePatternDatabases)
+        {
+            heuristic.reset(new PatternDatabaseHeuristic(options.patternDisks));
+        }
+        else
+        {
+            heuristic.reset(new MisplacedDiskHeuristic());
+        }
+
+        switch (options.algorithm)
+        {
+        case kSearchAlgorithm_Lean:
+            // a space too big for the lean search's arrays is far too big
+            // for the graph, so it falls back to IDA*
+            fallbackEngine.reset(new IdaStarEngine(*heuristic));
+            engine.reset(new LeanSearch(*fallbackEngine, "idastar"));
+            break;
+        case kSearchAlgorithm_External:
+            engine.reset(new ExternalSearch(options.workDir));
+            break;
+        case kSearchAlgorithm_Distributed:
+            engine.reset(new DistributedSearch(worldCommunicator, options.numNodes));
+            break;
+        case kSearchAlgorithm_AStar:
+            engine.reset(new AStarEngine(*heuristic));
+            break;
+        case kSearchAlgorithm_IdaStar:
+            engine.reset(new IdaStarEngine(*heuristic));
+            break;
+        default:
+            engine.reset(new BfsEngine(graph, options.bidirectional));
+            if (options.searchThreads > 1)
+            {
+                parallelSearch.reset(new ParallelSearch(options.searchThreads));
+                parallelSearch->maxMoves = options.maxMoves;
+            }
+            break;
+        }
+
+        engine->maxMoves = options.maxMoves;
+        engine->timePhases = options.collectTimes;
+        if (fallbackEngine)
+        {
+            fallbackEngine->maxMoves = options.maxMoves;
+        }
+        if (options.memoryBudget > 0)
+        {
+            budgetIdaStar.reset(new IdaStarEngine(*heuristic));
+            budgetLean.reset(new LeanSearch(*budgetIdaStar, "idastar"));
+            budgetIdaStar->maxMoves = options.maxMoves;
+            budgetIdaStar->timePhases = options.collectTimes;
+            budgetLean->maxMoves = options.maxMoves;
+            budgetLean->timePhases = options.collectTimes;
+        }
+        memset(reportedSizes, 0, sizeof(reportedSizes));
+        graphBuilt = false;
+        stats = SearchStats();
+    }
+
+    SearchEngine *FitBudget(int numDisks, int numPegs, ParallelSearch *& parallel);
+
+    SolverOptions options;
+    Graph graph;
+    SolutionCache cache;
+    FrameStewart frameStewart;
+    std::unique_ptr<Heuristic> heuristic;
+    std::unique_ptr<SearchEngine> fallbackEngine;
+    std::unique_ptr<SearchEngine> engine;
+    std::unique_ptr<ParallelSearch> parallelSearch;
+    std::unique_ptr<SearchEngine> budgetIdaStar;
+    std::unique_ptr<SearchEngine> budgetLean;
+    uint32_t reportedSizes[StateCodec::kMaxDisks + 1];   // bit K for a reported (N, K)
+    TargetSet targets;
+    bool graphBuilt;    // the last query searched the graph
+    SearchStats stats;
+};
+
+//==============================================================================
+//
+// Fit Budget
+//
+// The engine for a search of this size under options.memoryBudget: the
+// configured one (and parallel search, if any) when its estimate fits, else
+// the lean search, else IDA*. The external and distributed searches keep
+// their states on disk or spread over nodes and are left alone.
+//
+//==============================================================================
+SearchEngine *HanoiSolver::Context::FitBudget(int numDisks, int numPegs, ParallelSearch *& parallel)
+{
+    SearchAlgorithm algorithm = parallel ? kSearchAlgorithm_Lean : options.algorithm;
+    if (algorithm == kSearchAlgorithm_External || algorithm == kSearchAlgorithm_Distributed)
+    {
+        return engine.get();
+    }
+
+    double budget = options.memoryBudget;
+    double needed = EstimateSearchBytes(algorithm, numDisks, numPegs);
+    if (needed <= budget)
+    {
+        return engine.get();
+    }
+
+    SearchAlgorithm fitAlgorithm = kSearchAlgorithm_IdaStar;
+    SearchEngine *fit = budgetIdaStar.get();
+    if (algorithm != kSearchAlgorithm_Lean &&
+        EstimateSearchBytes(kSearchAlgorithm_Lean, numDisks, numPegs) <= budget)
+    {
+        fitAlgorithm = kSearchAlgorithm_Lean;
+        fit = budgetLean.get();
+    }
+
+    if (!(reportedSizes[numDisks] & (1u << numPegs)))
+    {
+        const char *name = parallel ? "parallel bfs" : AlgorithmName(algorithm);
+        std::cerr << "memory budget: " << numDisks << " disks on " << numPegs << " pegs ";
+        if (needed < 1e300)
+        {
+            bool megabytes = needed >= (1 << 20);
+            std::cerr << "needs about " << (uint64_t)(needed / (megabytes ? 1 << 20 : 1 << 10))
+                      << (megabytes ? " MB" : " KB") << " with " << name;
+        }
+        else
+        {
+            std::cerr << "is too big for " << name;
+        }
+        std::cerr << ", using " << AlgorithmName(fitAlgorithm) << " instead" << std::endl;
+        reportedSizes[numDisks] |= 1u << numPegs;
+    }
+    COUNT_STAT(stats.budgetFallbacks, 1);
+    parallel = NULL;
+    return fit;
+}
+
+//==============================================================================
+//
+// Solver Constructor / Destructor
+//
+//==============================================================================
+HanoiSolver::HanoiSolver(const SolverOptions& options) :
+    context(new Context(options)), numDisks(0), numPegs(0)
+{
+}
+
+HanoiSolver::~HanoiSolver()
+{
+}
+
+//==============================================================================
+//
+// Solver Configure
+//
+// Set the puzzle size for the following queries. Returns false, keeping the
+// previous size, if it is outside what the state encoding supports.
+//
+//==============================================================================
+bool HanoiSolver::Configure(int numDisks, int numPegs)
+{
+    if (numDisks < 1 || numDisks > StateCodec::kMaxDisks)
+    {
+        std::cerr << "number of disks must be between 1 and " << StateCodec::kMaxDisks << std::endl;
+        return false;
+    }
+    if (numPegs < MIN_PEGS || numPegs > StateCodec::kMaxPegs)
+    {
+        std::cerr << "number of pegs must be between " << MIN_PEGS << " and "
+                  << StateCodec::kMaxPegs << std::endl;
+        return false;
+    }
+    this->numDisks = numDisks;
+    this->numPegs = numPegs;
+    return true;
+}
+
+//==============================================================================
+//
+// Pack State
+//
+// Check a peg vector against the configured size and pack it for Solve.
+//
+//==============================================================================
+bool HanoiSolver::PackState(const std::vector<int>& pegs, StateCode& state) const
+{
+    if (numDisks == 0)
+    {
+        std::cerr << "solver used before Configure" << std::endl;
+        return false;
+    }
+    if ((int)pegs.size() != numDisks)
+    {
+        std::cerr << "expected a peg for each of the " << numDisks << " disks" << std::endl;
+        return false;
+    }
+
+    state = 0;
+    for (int i = 0; i < numDisks; i++)
+    {
+        if (pegs[i] < 0 || pegs[i] >= numPegs)
+        {
+            std::cerr << "peg of disk " << i << " must be between 0 and " << numPegs-1 << std::endl;
+            return false;
+        }
+        state = StateCodec::SetPeg(state, i, pegs[i]);
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Check State
+//
+// Check a packed state from a caller against the configured size: every
+// disk on one of the pegs and no bits set above the last disk.
+//
+//==============================================================================
+bool HanoiSolver::CheckState(StateCode state) const
+{
+    if (numDisks == 0)
+    {
+        std::cerr << "solver used before Configure" << std::endl;
+        return false;
+    }
+    if ((state >> (numDisks * StateCodec::kBitsPerDisk)) != 0)
+    {
+        std::cerr << "state has bits set above disk " << numDisks-1 << std::endl;
+        return false;
+    }
+    for (int i = 0; i < numDisks; i++)
+    {
+        if (StateCodec::GetPeg(state, i) >= numPegs)
+        {
+            std::cerr << "peg of disk " << i << " must be between 0 and " << numPegs-1 << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Bound Solution
+//
+// Apply maxMoves to an answer that did not come from a bounded search
+// (a cached, closed form or table solution), so every path agrees.
+//
+//==============================================================================
+static int BoundSolution(const SolverOptions& options, int numMoves, std::vector<Move>& moves)
+{
+    if (options.maxMoves >= 0 && numMoves > options.maxMoves)
+    {
+        moves.clear();
+        return -1;
+    }
+    return numMoves;
+}
+
+//==============================================================================
+//
+// Solver Solve
+//
+// Answer one puzzle by the cheapest means available: the closed form for
+// moving a whole tower, the solution cache, a precomputed distance table, or
+// finally the configured search engine. The peg vector version checks and
+// packs its arguments first.
+//
+//==============================================================================
+int HanoiSolver::Solve(const std::vector<int>& startPegs, const std::vector<int>& endPegs,
+        std::vector<Move>& moves)
+{
+    moves.clear();
+    StateCode startState, endState;
+    if (!PackState(startPegs, startState) || !PackState(endPegs, endState))
+    {
+        return -1;
+    }
+    return Solve(startState, endState, moves);
+}
+
+int HanoiSolver::Solve(StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    SearchStats& stats = context->stats;
+    COUNT_STAT(stats.numQueries, 1);
+    context->graphBuilt = false;
+    if (!CheckState(startState) || !CheckState(endState))
+    {
+        moves.clear();
+        return -1;
+    }
+
+    unsigned numResets = context->graph.numResets;
+    if (!context->options.collectTimes)
+    {
+        int numMoves = SolveQuery(startState, endState, moves);
+        context->graphBuilt = context->graph.numResets != numResets;
+        return numMoves;
+    }
+
+    double start = CurrentSeconds();
+    double pathSeconds = stats.pathSeconds;
+    int numMoves = SolveQuery(startState, endState, moves);
+    stats.searchSeconds += CurrentSeconds() - start - (stats.pathSeconds - pathSeconds);
+    context->graphBuilt = context->graph.numResets != numResets;
+    return numMoves;
+}
+
+int HanoiSolver::SolveQuery(StateCode startState, StateCode endState, std::vector<Move>& moves)
+{
+    const SolverOptions& options = context->options;
+    SolutionCache& cache = context->cache;
+
+    // the closed form is as cheap as a cache hit, so its answers are not cached
+    int numMoves = context->frameStewart.Solve(numDisks, numPegs, startState, endState, moves);
+    if (numMoves >= 0)
+    {
+        return BoundSolution(options, numMoves, moves);
+    }
+
+    SolutionCache::Key key;
+    key.numDisks = numDisks;
+    key.numPegs = numPegs;
+    key.startState = startState;
+    key.endState = endState;
+    if (cache.Lookup(key, moves))
+    {
+        return BoundSolution(options, moves.size(), moves);
+    }
+
+    // a table answers "all on one peg" targets without any search
+    DistanceTable *table = GetDistanceTable(numDisks, numPegs);
+    if (table)
+    {
+        numMoves = table->Solve(startState, endState, moves);
+    }
+
+    ParallelSearch *parallelSearch = context->parallelSearch.get();
+    SearchEngine *engine = context->engine.get();
+    if (numMoves < 0 && options.memoryBudget > 0)
+    {
+        engine = context->FitBudget(numDisks, numPegs, parallelSearch);
+    }
+
+    if (numMoves < 0 && parallelSearch && parallelSearch->Configure(numDisks, numPegs))
+    {
+        numMoves = parallelSearch->Solve(startState, endState, moves);
+        COUNT_STAT(context->stats.numSearches, 1);
+    }
+    else if (numMoves < 0)
+    {
+        numMoves = engine->Solve(numDisks, numPegs, startState, endState, moves);
+        COUNT_STAT(context->stats.numSearches, 1);
+        AddSearchStats(context->stats, engine->stats);
+    }
+
+    if (numMoves >= 0)
+    {
+        cache.Insert(key, moves);
+    }
+    return BoundSolution(options, numMoves, moves);
+}
+
+//==============================================================================
+//
+// Check Targets
+//
+// CheckState for the start and every end state of a multi-target query.
+//
+//==============================================================================
+bool HanoiSolver::CheckTargets(StateCode startState, const std::vector<StateCode>& endStates) const
+{
+    if (!CheckState(startState))
+    {
+        return false;
+    }
+    for (size_t i = 0; i < endStates.size(); i++)
+    {
+        if (!CheckState(endStates[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Solve Nearest / Solve Distances
+//
+// Multi-target queries, each answered by one breadth first search on the
+// solver's graph whatever the configured algorithm (and without the cache,
+// tables or closed form, which only know single targets). SolveNearest
+// returns the distance to a nearest end state and its index in endStates
+// (the first, if it is listed more than once), or -1 and an index of -1 if
+// none is within maxMoves. SolveDistances gives the distance to every end
+// state, -1 for those out of reach, and returns how many were reached.
+//
+//==============================================================================
+int HanoiSolver::SolveNearest(StateCode startState, const std::vector<StateCode>& endStates,
+        std::vector<Move>& moves, int& nearest)
+{
+    Graph& graph = context->graph;
+    SearchStats& stats = context->stats;
+    double start = context->options.collectTimes ? CurrentSeconds() : 0;
+
+    moves.clear();
+    nearest = -1;
+    context->graphBuilt = CheckTargets(startState, endStates);
+    if (!context->graphBuilt)
+    {
+        return -1;
+    }
+    graph.Configure(numDisks, numPegs);
+    graph.maxDistance = context->options.maxMoves;
+    context->targets.Build(numDisks, numPegs, endStates);
+    int numMoves = graph.ExploreTargets(startState, context->targets, false);
+
+    double pathStart = context->options.collectTimes ? CurrentSeconds() : 0;
+    if (numMoves >= 0)
+    {
+        graph.GetSolution(moves);
+        StateCode target = graph.vtxState[graph.meetForward];
+        nearest = std::find(endStates.begin(), endStates.end(), target) - endStates.begin();
+    }
+
+    COUNT_STAT(stats.numQueries, 1);
+    COUNT_STAT(stats.numSearches, 1);
+    COUNT_STAT(graph.stats.verticesCreated, graph.numVertices);
+    AddSearchStats(stats, graph.stats);
+    if (context->options.collectTimes)
+    {
+        double end = CurrentSeconds();
+        stats.searchSeconds += pathStart - start;
+        stats.pathSeconds += end - pathStart;
+    }
+    return numMoves;
+}
+
+int HanoiSolver::SolveDistances(StateCode startState, const std::vector<StateCode>& endStates,
+        std::vector<int>& distances)
+{
+    Graph& graph = context->graph;
+    SearchStats& stats = context->stats;
+    double start = context->options.collectTimes ? CurrentSeconds() : 0;
+
+    distances.clear();
+    context->graphBuilt = CheckTargets(startState, endStates);
+    if (!context->graphBuilt)
+    {
+        return 0;
+    }
+    graph.Configure(numDisks, numPegs);
+    graph.maxDistance = context->options.maxMoves;
+    context->targets.Build(numDisks, numPegs, endStates);
+    graph.ExploreTargets(startState, context->targets, true);
+
+    int numReached = 0;
+    distances.resize(endStates.size());
+    for (size_t i = 0; i < endStates.size(); i++)
+    {
+        int vtx = graph.FindVertex(endStates[i]);
+        distances[i] = vtx == Graph::kNoVertex ? -1 : graph.vtxDistance[vtx];
+        if (distances[i] >= 0)
+        {
+            numReached++;
+        }
+    }
+
+    COUNT_STAT(stats.numQueries, 1);
+    COUNT_STAT(stats.numSearches, 1);
+    COUNT_STAT(graph.stats.verticesCreated, graph.numVertices);
+    AddSearchStats(stats, graph.stats);
+    if (context->options.collectTimes)
+    {
+        stats.searchSeconds += CurrentSeconds() - start;
+    }
+    return numReached;
+}
+
+//==============================================================================
+//
+// Solver Cache
+//
+// Thin wrappers over the solver's SolutionCache. MergeCache copies another
+// solver's entries and adds its hit counts; ClearCache empties the cache and
+// resets the counts.
+//
+//==============================================================================
+bool HanoiSolver::LoadCache(const char *fileName)
+{
+    return context->cache.Load(fileName);
+}
+
+bool HanoiSolver::SaveCache(const char *fileName)
+{
+    return context->cache.Save(fileName);
+}
+
+void HanoiSolver::MergeCache(const HanoiSolver& other)
+{
+    context->cache.Merge(other.context->cache);
+}
+
+void HanoiSolver::ClearCache(void)
+{
+    context->cache = SolutionCache(context->options.cacheEntries);
+}
+
+void HanoiSolver::GetCacheStats(size_t& hits, size_t& misses) const
+{
+    hits = context->cache.hits;
+    misses = context->cache.misses;
+}
+
+//==============================================================================
+//
+// Solver Stats
+//
+//==============================================================================
+void AddSearchStats(SearchStats& total, const SearchStats& stats)
+{
+    total.numQueries += stats.numQueries;
+    total.numSearches += stats.numSearches;
+    total.verticesCreated += stats.verticesCreated;
+    total.statesExpanded += stats.statesExpanded;
+    total.edgesGenerated += stats.edgesGenerated;
+    total.duplicateHits += stats.duplicateHits;
+    total.frontierPeak = std::max(total.frontierPeak, stats.frontierPeak);
+    total.budgetFallbacks += stats.budgetFallbacks;
+    total.searchSeconds += stats.searchSeconds;
+    total.pathSeconds += stats.pathSeconds;
+}
+
+void HanoiSolver::GetStats(SearchStats& stats) const
+{
+    stats = context->stats;
+}
+
+void HanoiSolver::ResetStats(void)
+{
+    context->stats = SearchStats();
+}
+
+//==============================================================================
+//
+// Solver Dump Graph
+//
+// Only the last query's graph is written; one answered without searching
+// the graph (by the closed form, the cache, a table or another engine)
+// leaves nothing to dump.
+//
+//==============================================================================
+bool HanoiSolver::DumpGraph(const char *fileName)
+{
+    if (!context->graphBuilt)
+    {
+        std::cerr << "no graph to dump: the last query was answered without a graph search"
+                  << std::endl;
+        return false;
+    }
+    return ::DumpGraph(&context->graph, fileName);
 }
@@ -0,0 +1,251 @@
+//==============================================================================
+//
+// FBHanoi.h
+//
+// The solver as a library. A HanoiSolver is set up once with the search to
+// use, sized for a puzzle with Configure, and then asked any number of
+// Solve queries; the graph, caches and search buffers it owns are reused
+// from one query to the next, so a long running process can answer many
+// puzzles without starting a new one per query. FBHanoiMain.cpp is the
+// command line program built on top of it.
+//
+// The distance tables and pattern databases are shared by every solver in
+// the process: load them once before solving (and before starting threads).
+// A HanoiSolver itself is not thread safe; give each thread its own.
+//
+// FBHANOI_WIDE_STATE and FBHANOI_USE_MPI must be defined the same way for the
+// library and everything that includes this header.
+//
+//==============================================================================
+#ifndef FBHANOI_H
+#define FBHANOI_H
+
+#include <vector>
+#include <memory>
+#include <chrono>
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// fewest pegs accepted in a puzzle; with two pegs most puzzles are unsolvable
+#define MIN_PEGS 3
+
+// largest pattern a pattern database is built for
+#define MAX_PATTERN_DISKS 8
+
+//==============================================================================
+//
+// Packed state encoding
+//
+// A "state" records which (zero based) peg every disk sits on. Rather than
+// keeping a vector per state, the pegs are packed into a single integer with
+// kBitsPerDisk bits per disk, disk 0 in the least significant bits. The Word
+// type bounds how many disks fit: 10 for 32 bits, 21 for 64 bits.
+//
+//==============================================================================
+template <typename Word>
+struct BasicStateCodec
+{
+    typedef Word Code;
+
+    static const int kBitsPerDisk = 3;
+    static const int kMaxDisks = (sizeof(Word) * 8) / kBitsPerDisk;
+    static const int kMaxPegs = 1 << kBitsPerDisk;
+    static const Word kPegMask = (1 << kBitsPerDisk) - 1;
+
+    static int GetPeg(Code code, int disk)
+    {
+        return (int)((code >> (disk * kBitsPerDisk)) & kPegMask);
+    }
+
+    static Code SetPeg(Code code, int disk, int peg)
+    {
+        int shift = disk * kBitsPerDisk;
+        return (code & ~(kPegMask << shift)) | ((Code)peg << shift);
+    }
+};
+
+// define FBHANOI_WIDE_STATE to trade a larger state for more disks
+#ifdef FBHANOI_WIDE_STATE
+typedef uint64_t StateCode;
+#else
+typedef uint32_t StateCode;
+#endif
+typedef BasicStateCodec<StateCode> StateCodec;
+
+// a single move: pick the top disk off one (zero based) peg, drop it on another
+typedef struct Move
+{
+    uint8_t fromPeg;
+    uint8_t toPeg;
+} Move;
+
+//==============================================================================
+//
+// Solver options
+//
+// How a HanoiSolver answers the puzzles it cannot look up. The constructor
+// fills in the defaults: a one-sided bfs with a solution cache of
+// DEFAULT_CACHE_ENTRIES entries and no bound on the solution length.
+//
+//==============================================================================
+typedef enum SearchAlgorithm
+{
+    kSearchAlgorithm_Bfs,
+    kSearchAlgorithm_Lean,
+    kSearchAlgorithm_External,
+    kSearchAlgorithm_Distributed,
+    kSearchAlgorithm_AStar,
+    kSearchAlgorithm_IdaStar
+} SearchAlgorithm;
+
+typedef struct SolverOptions
+{
+    SolverOptions();
+
+    SearchAlgorithm algorithm;
+    bool bidirectional;
+    bool symmetry;
+    bool sortFrontier;
+    int maxMoves;               // -1 for no bound
+    int searchThreads;          // threads for a single bfs query
+    size_t cacheEntries;
+    bool usePatternDatabases;   // estimate with the loaded pattern databases
+    int patternDisks;
+    const char *workDir;        // for kSearchAlgorithm_External
+    int numNodes;               // for kSearchAlgorithm_Distributed
+    bool collectTimes;          // fill in the SearchStats timings
+    size_t memoryBudget;        // bytes a single-target search may use, 0 for no limit
+} SolverOptions;
+
+//==============================================================================
+//
+// Search statistics
+//
+// What a HanoiSolver has done since it was made or its stats were reset.
+// The counters cover the bfs, lean, astar and idastar searches (the others
+// only count as searches) and cost a few increments per expanded state;
+// defining FBHANOI_NO_STATS compiles them out, leaving them zero. The
+// timings need SolverOptions::collectTimes, as reading the clock on every
+// query is not free.
+//
+//==============================================================================
+typedef struct SearchStats
+{
+    uint64_t numQueries;        // Solve calls
+    uint64_t numSearches;       // queries that needed a search
+    uint64_t verticesCreated;   // states a search recorded
+    uint64_t statesExpanded;    // states whose moves were generated
+    uint64_t edgesGenerated;    // successors generated
+    uint64_t duplicateHits;     // successors a search had already recorded
+    uint64_t frontierPeak;      // largest BFS level or A* open list
+    uint64_t budgetFallbacks;   // searches memoryBudget moved to a leaner engine
+    double searchSeconds;       // in Solve, bar path reconstruction
+    double pathSeconds;         // rebuilding move lists from a search
+} SearchStats;
+
+// add stats into total, keeping the larger frontierPeak
+void AddSearchStats(SearchStats& total, const SearchStats& stats);
+
+// the monotonic clock the timings are read from
+inline double CurrentSeconds(void)
+{
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//==============================================================================
+//
+// Class declaration for the solver
+//
+// Solve returns the number of moves of a minimal solution and fills in the
+// moves, or returns -1 when there is none within options.maxMoves (or the
+// query was invalid, which is reported on std::cerr). Pegs are zero based in
+// both the peg vectors (one entry per disk, smallest disk first) and the
+// moves; packed states are built with StateCodec::SetPeg.
+//
+// With a memoryBudget, a search whose worst case would not fit is run by the
+// leanest engine that does: the rank-indexed lean search, else IDA*, which
+// stores no graph. Each switch is reported on std::cerr once per puzzle size.
+// The multi-target queries always use the graph.
+//
+//==============================================================================
+class HanoiSolver
+{
+public:
+    HanoiSolver(const SolverOptions& options = SolverOptions());
+
+    ~HanoiSolver();
+
+    bool Configure(int numDisks, int numPegs);
+
+    int Solve(const std::vector<int>& startPegs, const std::vector<int>& endPegs,
+            std::vector<Move>& moves);
+    int Solve(StateCode startState, StateCode endState, std::vector<Move>& moves);
+    bool PackState(const std::vector<int>& pegs, StateCode& state) const;
+
+    // one search from startState for several (packed) end states: the path
+    // to a nearest one and its index, or the distances to all of them. An
+    // invalid state is reported and gives -1, or no distances and 0.
+    int SolveNearest(StateCode startState, const std::vector<StateCode>& endStates,
+            std::vector<Move>& moves, int& nearest);
+    int SolveDistances(StateCode startState, const std::vector<StateCode>& endStates,
+            std::vector<int>& distances);
+
+    // the solution cache, which can be kept in a file between processes
+    bool LoadCache(const char *fileName);
+    bool SaveCache(const char *fileName);
+    void MergeCache(const HanoiSolver& other);
+    void ClearCache(void);
+    void GetCacheStats(size_t& hits, size_t& misses) const;
+
+    void GetStats(SearchStats& stats) const;
+    void ResetStats(void);
+
+    // write the graph explored by the last query, failing if it did not
+    // search the graph
+    bool DumpGraph(const char *fileName);
+
+private:
+    HanoiSolver(const HanoiSolver&);
+    HanoiSolver& operator=(const HanoiSolver&);
+
+    struct Context;
+
+    bool CheckState(StateCode state) const;
+    bool CheckTargets(StateCode startState, const std::vector<StateCode>& endStates) const;
+    int SolveQuery(StateCode startState, StateCode endState, std::vector<Move>& moves);
+
+    std::unique_ptr<Context> context;
+    int numDisks;
+    int numPegs;
+};
+
+//==============================================================================
+//
+// Shared tables
+//
+// Distance tables (one per puzzle size the problem statement allows) answer
+// "all on one peg" targets without a search; pattern databases give A* and
+// IDA* their estimates. Build writes a full set into a directory, Load maps
+// whatever files are present.
+//
+//==============================================================================
+bool BuildDistanceTables(const char *dir);
+void LoadDistanceTables(const char *dir);
+bool BuildPatternDatabases(const char *dir);
+void LoadPatternDatabases(const char *dir);
+
+// print BFS layer sizes outward from startState over the whole state space,
+// optionally writing every state's distance to distanceFile
+bool ExploreAllDistances(int numDisks, int numPegs, StateCode startState,
+        const char *distanceFile, FILE *output);
+
+#ifdef FBHANOI_USE_MPI
+// make distributed searches span every process of MPI_COMM_WORLD (after
+// MPI_Init); returns the number of processes and sets rank to this one's
+int JoinMpiWorld(int& rank);
+#endif
+
+#endif // FBHANOI_H
@@ -0,0 +1,443 @@
+//==============================================================================
+//
+// FBHanoiBench.cpp
+//
+// Micro and macro benchmarks for the solver, written as one JSON object on
+// STDOUT so runs can be stored and compared:
+//
+//   lookup  Graph::GetVertex, creating vertices and then finding them again
+//   expand  move generation through ExpandStates (and the scalar version)
+//   search  BuildAndExplore for every table sized (N, K), on random pairs and
+//           on a worst case pair (a state farthest from "all on the first peg")
+//   batch   HanoiSolver throughput on random puzzles, the cache turned off
+//
+// The micro benchmarks need the library's internals, so this file is built
+// as a single translation unit with it:
+//
+//   g++ -std=c++11 -O2 -pthread -o FBHanoiBench FBHanoiBench.cpp
+//
+//==============================================================================
+#include "FBHanoi.cpp"
+
+#include <new>
+
+#include <malloc.h>       // for malloc_usable_size
+#include <sys/resource.h> // for getrusage
+
+// states each lookup and expansion benchmark works on
+#define BENCH_LOOKUP_STATES (1 << 20)
+#define BENCH_EXPAND_STATES (1 << 16)
+
+// the expansion benchmark repeats until it has generated this many states
+#define BENCH_EXPAND_SUCCESSORS (1 << 25)
+
+// defaults for the macro benchmarks
+#define DEFAULT_BENCH_PAIRS 20
+#define DEFAULT_BENCH_PUZZLES 2000
+
+//==============================================================================
+//
+// Allocation counting
+//
+// Every operator new in the process goes through here, so a benchmark can
+// read the count before and after the code it measures. The live heap (as
+// malloc_usable_size counts it) and its high-water mark are tracked too;
+// ResetHeapPeak starts a new high-water mark from what is live now.
+//
+//==============================================================================
+static std::atomic<uint64_t> numAllocations(0);
+static std::atomic<uint64_t> liveHeapBytes(0);
+static std::atomic<uint64_t> peakHeapBytes(0);
+
+void *operator new(size_t size)
+{
+    numAllocations.fetch_add(1, std::memory_order_relaxed);
+    void *block = malloc(size ? size : 1);
+    if (!block)
+    {
+        throw std::bad_alloc();
+    }
+
+    size = malloc_usable_size(block);
+    uint64_t live = liveHeapBytes.fetch_add(size, std::memory_order_relaxed) + size;
+    uint64_t peak = peakHeapBytes.load(std::memory_order_relaxed);
+    while (live > peak && !peakHeapBytes.compare_exchange_weak(peak, live,
+            std::memory_order_relaxed))
+    {
+    }
+    return block;
+}
+
+// kept out of line, or GCC sees the inlined free() against operator new and
+// warns of a mismatch
+__attribute__((noinline))
+void operator delete(void *block) noexcept
+{
+    if (block)
+    {
+        liveHeapBytes.fetch_sub(malloc_usable_size(block), std::memory_order_relaxed);
+        free(block);
+    }
+}
+
+void operator delete(void *block, size_t) noexcept
+{
+    operator delete(block);
+}
+
+static void ResetHeapPeak(void)
+{
+    peakHeapBytes.store(liveHeapBytes.load());
+}
+
+//==============================================================================
+//
+// Benchmark helpers
+//
+//==============================================================================
+static long PeakRssKb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// xorshift64*, so runs with the same seed see the same puzzles everywhere
+static uint64_t randomState = 1;
+
+static uint64_t NextRandom(void)
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return randomState * 0x2545F4914F6CDD1Dull;
+}
+
+static StateCode RandomState(int numDisks, int numPegs)
+{
+    StateCode state = 0;
+    for (int i = 0; i < numDisks; i++)
+    {
+        state = StateCodec::SetPeg(state, i, NextRandom() % numPegs);
+    }
+    return state;
+}
+
+static StateCode UnrankState(StateRank rank, int numDisks, int numPegs)
+{
+    StateCode state = 0;
+    for (int i = 0; i < numDisks; i++)
+    {
+        state = StateCodec::SetPeg(state, i, rank % numPegs);
+        rank /= numPegs;
+    }
+    return state;
+}
+
+static StateRank NumStates(int numDisks, int numPegs)
+{
+    StateRank numStates = 1;
+    for (int i = 0; i < numDisks; i++)
+    {
+        numStates *= numPegs;
+    }
+    return numStates;
+}
+
+// every state once in random order if there are few enough, else a sample
+static void SampleStates(int numDisks, int numPegs, size_t maxStates, std::vector<StateCode>& states)
+{
+    StateRank numStates = NumStates(numDisks, numPegs);
+    states.clear();
+    if (numStates <= maxStates)
+    {
+        for (StateRank rank = 0; rank < numStates; rank++)
+        {
+            states.push_back(UnrankState(rank, numDisks, numPegs));
+        }
+        for (size_t i = states.size(); i > 1; i--)
+        {
+            std::swap(states[i-1], states[NextRandom() % i]);
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < maxStates; i++)
+        {
+            states.push_back(RandomState(numDisks, numPegs));
+        }
+    }
+}
+
+//==============================================================================
+//
+// Bench Lookup
+//
+// Time GetVertex on a fresh graph (every call adds a vertex, bar repeats in a
+// random sample) and then on the same states again (every call finds one).
+//
+//==============================================================================
+static void BenchLookup(int numDisks, int numPegs, bool firstRecord)
+{
+    std::vector<StateCode> states;
+    SampleStates(numDisks, numPegs, BENCH_LOOKUP_STATES, states);
+
+    Graph graph(numDisks, numPegs);
+    graph.Reset();
+    volatile int sink = 0;
+
+    double start = CurrentSeconds();
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        sink += graph.GetVertex(states[i]);
+    }
+    double insertSeconds = CurrentSeconds() - start;
+
+    start = CurrentSeconds();
+    for (size_t i = 0; i < states.size(); i++)
+    {
+        sink += graph.GetVertex(states[i]);
+    }
+    double findSeconds = CurrentSeconds() - start;
+
+    printf("%s    {\"disks\": %d, \"pegs\": %d, \"index\": \"%s\", \"calls\": %zu,"
+           " \"nsPerInsert\": %.2f, \"nsPerFind\": %.2f}",
+           firstRecord ? "" : ",\n", numDisks, numPegs, graph.useDenseIndex ? "dense" : "sparse",
+           states.size(), insertSeconds * 1e9 / states.size(), findSeconds * 1e9 / states.size());
+}
+
+//==============================================================================
+//
+// Bench Expand
+//
+// Time one ExpandStates kernel over a sample of states, in batches of
+// EXPAND_BATCH_STATES the way the searches call it.
+//
+//==============================================================================
+static void BenchExpand(int numDisks, int numPegs, const char *kernelName,
+        ExpandStatesFunction expand, bool firstRecord)
+{
+    std::vector<StateCode> states;
+    SampleStates(numDisks, numPegs, BENCH_EXPAND_STATES, states);
+
+    StateCode newStates[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    Move newMoves[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    int parents[EXPAND_BATCH_STATES * MAX_MOVES_PER_STATE];
+    uint64_t numExpanded = 0;
+    uint64_t numSuccessors = 0;
+
+    double start = CurrentSeconds();
+    while (numSuccessors < BENCH_EXPAND_SUCCESSORS)
+    {
+        for (size_t head = 0; head < states.size(); head += EXPAND_BATCH_STATES)
+        {
+            int numCurrent = std::min((size_t)EXPAND_BATCH_STATES, states.size() - head);
+            int numMoves = expand(&states[head], numCurrent, numDisks, numPegs,
+                    newStates, newMoves, parents);
+            numExpanded += numCurrent;
+            numSuccessors += numMoves;
+        }
+    }
+    double seconds = CurrentSeconds() - start;
+
+    printf("%s    {\"disks\": %d, \"pegs\": %d, \"kernel\": \"%s\", \"expansions\": %llu,"
+           " \"nsPerExpansion\": %.2f, \"nsPerSuccessor\": %.3f}",
+           firstRecord ? "" : ",\n", numDisks, numPegs, kernelName, (unsigned long long)numExpanded,
+           seconds * 1e9 / numExpanded, seconds * 1e9 / numSuccessors);
+}
+
+//==============================================================================
+//
+// Bench Search
+//
+// Time BuildAndExplore plus GetSolution on one puzzle size. The graph is
+// warmed up with one search first, so the allocation count shows what a
+// steady stream of queries costs rather than the first one's setup. Each
+// size gets a fresh graph, and peakHeapKb is the most heap it held at once
+// (from the warm up on) beyond what was live before.
+//
+//==============================================================================
+static void BenchSearch(int numDisks, int numPegs, const char *kind,
+        const std::vector<std::pair<StateCode, StateCode> >& pairs, bool firstRecord)
+{
+    uint64_t baseHeapBytes = liveHeapBytes.load();
+    ResetHeapPeak();
+
+    std::vector<Move> moves;
+    Graph graph(numDisks, numPegs);
+    graph.maxDistance = -1;
+    graph.BuildAndExplore(pairs[0].first, pairs[0].second);
+    graph.GetSolution(moves);
+
+    uint64_t numVertices = 0;
+    uint64_t totalMoves = 0;
+    uint64_t allocations = numAllocations.load();
+    double start = CurrentSeconds();
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        int numMoves = graph.BuildAndExplore(pairs[i].first, pairs[i].second);
+        graph.GetSolution(moves);
+        numVertices += graph.numVertices;
+        totalMoves += numMoves;
+    }
+    double seconds = CurrentSeconds() - start;
+    allocations = numAllocations.load() - allocations;
+    uint64_t heapBytes = peakHeapBytes.load() - baseHeapBytes;
+
+    printf("%s    {\"disks\": %d, \"pegs\": %d, \"pairs\": \"%s\", \"solves\": %zu,"
+           " \"meanMoves\": %.2f, \"meanVertices\": %.1f, \"usPerSolve\": %.2f,"
+           " \"verticesPerSecond\": %.0f, \"allocationsPerSolve\": %.2f, \"peakHeapKb\": %llu}",
+           firstRecord ? "" : ",\n", numDisks, numPegs, kind, pairs.size(),
+           (double)totalMoves / pairs.size(), (double)numVertices / pairs.size(),
+           seconds * 1e6 / pairs.size(), seconds > 0 ? numVertices / seconds : 0.0,
+           (double)allocations / pairs.size(), (unsigned long long)(heapBytes >> 10));
+}
+
+//==============================================================================
+//
+// Bench Batch
+//
+// Solve random puzzles of random size in the problem statement's range with
+// one HanoiSolver, the way the command line batch mode does (one thread,
+// closed form and tables as loaded, no cache).
+//
+//==============================================================================
+static void BenchBatch(int numPuzzles, int maxDisks)
+{
+    SolverOptions options;
+    options.cacheEntries = 0;
+    HanoiSolver solver(options);
+
+    std::vector<int> sizes;
+    std::vector<StateCode> starts, ends;
+    for (int i = 0; i < numPuzzles; i++)
+    {
+        int numDisks = 1 + NextRandom() % maxDisks;
+        int numPegs = MIN_TABLE_PEGS + NextRandom() % (MAX_TABLE_PEGS - MIN_TABLE_PEGS + 1);
+        sizes.push_back(numDisks * 16 + numPegs);
+        starts.push_back(RandomState(numDisks, numPegs));
+        ends.push_back(RandomState(numDisks, numPegs));
+    }
+
+    std::vector<Move> moves;
+    uint64_t totalMoves = 0;
+    uint64_t allocations = numAllocations.load();
+    double start = CurrentSeconds();
+    for (int i = 0; i < numPuzzles; i++)
+    {
+        solver.Configure(sizes[i] / 16, sizes[i] % 16);
+        totalMoves += solver.Solve(starts[i], ends[i], moves);
+    }
+    double seconds = CurrentSeconds() - start;
+    allocations = numAllocations.load() - allocations;
+
+    printf("  \"batch\": {\"puzzles\": %d, \"maxDisks\": %d, \"meanMoves\": %.2f,"
+           " \"puzzlesPerSecond\": %.1f, \"allocationsPerSolve\": %.2f},\n",
+           numPuzzles, maxDisks, (double)totalMoves / numPuzzles,
+           seconds > 0 ? numPuzzles / seconds : 0.0, (double)allocations / numPuzzles);
+}
+
+//==============================================================================
+//
+// main
+//
+//==============================================================================
+int main(int argc, char **argv)
+{
+    uint64_t seed = 1;
+    int numPairs = DEFAULT_BENCH_PAIRS;
+    int numPuzzles = DEFAULT_BENCH_PUZZLES;
+    int maxDisks = MAX_TABLE_DISKS;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--seed") == 0 && i+1 < argc)
+        {
+            seed = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--pairs") == 0 && i+1 < argc)
+        {
+            numPairs = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--puzzles") == 0 && i+1 < argc)
+        {
+            numPuzzles = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--max-disks") == 0 && i+1 < argc)
+        {
+            maxDisks = std::min(std::max(1, atoi(argv[++i])), MAX_TABLE_DISKS);
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0]
+                      << " [--seed N] [--pairs N] [--puzzles N] [--max-disks N]" << std::endl;
+            return 1;
+        }
+    }
+    randomState = seed ? seed : 1;
+
+    const char *kernelName = "scalar";
+#ifdef FBHANOI_AVX2_KERNEL
+    if (ExpandStates == ExpandStatesAvx2)
+    {
+        kernelName = "avx2";
+    }
+#endif
+    printf("{\n  \"seed\": %llu,\n  \"stateBits\": %d,\n  \"expandKernel\": \"%s\",\n",
+            (unsigned long long)seed, (int)sizeof(StateCode) * 8, kernelName);
+
+    static const int lookupSizes[][2] = { {6, 3}, {8, 4}, {8, 5}, {10, 5} };
+    printf("  \"lookup\": [\n");
+    for (size_t i = 0; i < sizeof(lookupSizes) / sizeof(lookupSizes[0]); i++)
+    {
+        BenchLookup(lookupSizes[i][0], lookupSizes[i][1], i == 0);
+    }
+    printf("\n  ],\n");
+
+    printf("  \"expand\": [\n");
+    bool first = true;
+    for (int numPegs = MIN_TABLE_PEGS; numPegs <= MAX_TABLE_PEGS; numPegs++)
+    {
+        BenchExpand(MAX_TABLE_DISKS, numPegs, "scalar", ExpandStatesScalar, first);
+        first = false;
+#ifdef FBHANOI_AVX2_KERNEL
+        if (ExpandStates == ExpandStatesAvx2)
+        {
+            BenchExpand(MAX_TABLE_DISKS, numPegs, "avx2", ExpandStatesAvx2, false);
+        }
+#endif
+    }
+    printf("\n  ],\n");
+
+    printf("  \"search\": [\n");
+    first = true;
+    for (int numDisks = 1; numDisks <= maxDisks; numDisks++)
+    {
+        for (int numPegs = MIN_TABLE_PEGS; numPegs <= MAX_TABLE_PEGS; numPegs++)
+        {
+            std::vector<std::pair<StateCode, StateCode> > pairs;
+            for (int i = 0; i < numPairs; i++)
+            {
+                pairs.push_back(std::make_pair(RandomState(numDisks, numPegs),
+                        RandomState(numDisks, numPegs)));
+            }
+            BenchSearch(numDisks, numPegs, "random", pairs, first);
+            first = false;
+
+            // the end is rank 0, all disks on the first peg
+            std::vector<uint8_t> distances;
+            ComputeDistances(numDisks, numPegs, distances);
+            StateRank farthest = std::max_element(distances.begin(), distances.end()) -
+                distances.begin();
+            pairs.assign(numPairs, std::make_pair(UnrankState(farthest, numDisks, numPegs),
+                    (StateCode)0));
+            BenchSearch(numDisks, numPegs, "worst", pairs, false);
+        }
+    }
+    printf("\n  ],\n");
+
+    BenchBatch(numPuzzles, maxDisks);
+
+    // process wide; the per-size figures are in search[].peakHeapKb
+    printf("  \"peakRssKb\": %ld\n}\n", PeakRssKb());
+    return 0;
+}
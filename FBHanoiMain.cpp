@@ -0,0 +1,1417 @@
+#include "FBHanoi.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include <stdint.h>
+
+#include <cstring> // for strcmp
+#include <cstdlib> // for strtol, strtod
+#include <climits> // for INT_MAX, LONG_MAX
+#include <cstdio>  // for snprintf
+
+#include <fcntl.h>    // for open
+#include <unistd.h>   // for close, read, write
+#include <errno.h>    // for EINTR, ERANGE
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+
+#ifdef FBHANOI_USE_MPI
+#include <mpi.h>
+#endif
+
+// granularity in which STDIN is slurped into memory
+#define INPUT_READ_CHUNK (1 << 16)
+
+// batch mode output is written once this much has been buffered
+#define OUTPUT_FLUSH_BYTES (1 << 16)
+
+// multi-threaded batches are read and solved this many puzzles at a time,
+// and handed to the workers in tasks of BATCH_TASK_PUZZLES puzzles
+#define BATCH_CHUNK_PUZZLES (1 << 16)
+#define BATCH_TASK_PUZZLES 16
+
+// most end configurations one --targets puzzle may list
+#define MAX_PUZZLE_TARGETS (1 << 20)
+
+//==============================================================================
+//
+// Class declaration for the input reader
+//
+// The whole input is brought into memory up front, either by memory-mapping
+// a file or by slurping STDIN in large reads, and then scanned in place.
+// Integers are separated by any run of whitespace (spaces, tabs, CR, LF).
+// Anything else, or a value out of the allowed range, is reported with its
+// line number and puts the reader into the failed state.
+//
+//==============================================================================
+class InputReader
+{
+public:
+    InputReader() : failed(false), begin(NULL), cur(NULL), end(NULL), mapping(NULL), mappingSize(0) { }
+
+    ~InputReader();
+
+    bool Open(const char *fileName);
+    bool AtEnd(void);
+    bool NextInt(int& value, int minValue, int maxValue, const char *what);
+
+    bool failed;
+
+private:
+    void Fail(const char *message, const char *what);
+
+    const char *begin;
+    const char *cur;
+    const char *end;
+    std::vector<char> buffer;
+    void *mapping;
+    size_t mappingSize;
+};
+
+//==============================================================================
+//
+// Input Reader Destructor
+//
+//==============================================================================
+InputReader::~InputReader()
+{
+    if (mapping)
+    {
+        munmap(mapping, mappingSize);
+    }
+}
+
+//==============================================================================
+//
+// Input Reader Open
+//
+// Map the named file, or read all of STDIN if fileName is NULL.
+//
+//==============================================================================
+bool InputReader::Open(const char *fileName)
+{
+    if (fileName)
+    {
+        int fd = open(fileName, O_RDONLY);
+        struct stat fileInfo;
+        if (fd < 0 || fstat(fd, &fileInfo) != 0)
+        {
+            std::cerr << "cannot open " << fileName << std::endl;
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return false;
+        }
+
+        if (fileInfo.st_size > 0)
+        {
+            void *data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                std::cerr << "cannot map " << fileName << std::endl;
+                close(fd);
+                return false;
+            }
+            madvise(data, fileInfo.st_size, MADV_SEQUENTIAL);
+            mapping = data;
+            mappingSize = fileInfo.st_size;
+        }
+        close(fd);
+
+        begin = (const char *)mapping;
+        end = begin + mappingSize;
+    }
+    else
+    {
+        size_t size = 0;
+        for (;;)
+        {
+            buffer.resize(size + INPUT_READ_CHUNK);
+            ssize_t numRead = read(0, &buffer[size], INPUT_READ_CHUNK);
+            if (numRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (numRead < 0)
+            {
+                std::cerr << "failed reading input" << std::endl;
+                return false;
+            }
+            if (numRead == 0)
+            {
+                break;
+            }
+            size += numRead;
+        }
+
+        buffer.resize(size);
+        begin = buffer.empty() ? NULL : &buffer[0];
+        end = begin + size;
+    }
+    cur = begin;
+    return true;
+}
+
+//==============================================================================
+//
+// At End
+//
+// skip whitespace, returning true if nothing but whitespace was left
+//
+//==============================================================================
+bool InputReader::AtEnd(void)
+{
+    while (cur < end && (*cur == ' ' || *cur == '\n' || *cur == '\r' ||
+                *cur == '\t' || *cur == '\v' || *cur == '\f'))
+    {
+        cur++;
+    }
+    return cur == end;
+}
+
+//==============================================================================
+//
+// Next Integer
+//
+// Scan the next non-negative integer and check it lies in [minValue,
+// maxValue]; "what" names the value in error messages.
+//
+//==============================================================================
+bool InputReader::NextInt(int& value, int minValue, int maxValue, const char *what)
+{
+    if (failed)
+    {
+        return false;
+    }
+    if (AtEnd())
+    {
+        Fail("unexpected end of input reading", what);
+        return false;
+    }
+
+    const char *start = cur;
+    long long result = 0;
+    while (cur < end && *cur >= '0' && *cur <= '9')
+    {
+        // saturate rather than overflow; anything this big is out of range
+        if (result <= maxValue)
+        {
+            result = result*10 + (*cur - '0');
+        }
+        cur++;
+    }
+
+    if (cur == start || (cur < end && !(*cur == ' ' || *cur == '\n' || *cur == '\r' ||
+                *cur == '\t' || *cur == '\v' || *cur == '\f')))
+    {
+        Fail("malformed", what);
+        return false;
+    }
+    if (result < minValue || result > maxValue)
+    {
+        Fail("out of range", what);
+        return false;
+    }
+
+    value = (int)result;
+    return true;
+}
+
+//==============================================================================
+//
+// Fail
+//
+// report an input error along with the line it occurred on
+//
+//==============================================================================
+void InputReader::Fail(const char *message, const char *what)
+{
+    int line = 1 + std::count(begin, cur, '\n');
+    std::cerr << "input line " << line << ": " << message << " " << what << std::endl;
+    failed = true;
+}
+
+//==============================================================================
+//
+// Read Puzzle
+//
+// Read one "N K / start / end" puzzle. Returns false at the end of the input
+// or if the puzzle is malformed (in which case reader.failed is set).
+//
+// ReadTargetPuzzle reads the --targets form instead, "N K / start / M"
+// followed by M end configurations, leaving puzzle.endState unset.
+//
+//==============================================================================
+typedef struct Puzzle
+{
+    int numDisks;
+    int numPegs;
+    StateCode startState;
+    StateCode endState;
+} Puzzle;
+
+static bool ReadState(InputReader& reader, const Puzzle& puzzle, const char *what,
+        StateCode& state)
+{
+    state = 0;
+    int peg;
+    for (int i = 0; i < puzzle.numDisks; i++)
+    {
+        if (!reader.NextInt(peg, 1, puzzle.numPegs, what))
+        {
+            return false;
+        }
+        state = StateCodec::SetPeg(state, i, peg-1);
+    }
+    return true;
+}
+
+static bool ReadPuzzleStart(InputReader& reader, Puzzle& puzzle)
+{
+    return !reader.AtEnd() &&
+        reader.NextInt(puzzle.numDisks, 1, StateCodec::kMaxDisks, "number of disks") &&
+        reader.NextInt(puzzle.numPegs, MIN_PEGS, StateCodec::kMaxPegs, "number of pegs") &&
+        ReadState(reader, puzzle, "start peg", puzzle.startState);
+}
+
+bool ReadPuzzle(InputReader& reader, Puzzle& puzzle)
+{
+    return ReadPuzzleStart(reader, puzzle) &&
+        ReadState(reader, puzzle, "end peg", puzzle.endState);
+}
+
+bool ReadTargetPuzzle(InputReader& reader, Puzzle& puzzle, std::vector<StateCode>& endStates)
+{
+    int numTargets;
+    if (!ReadPuzzleStart(reader, puzzle) ||
+            !reader.NextInt(numTargets, 1, MAX_PUZZLE_TARGETS, "number of targets"))
+    {
+        return false;
+    }
+
+    endStates.resize(numTargets);
+    for (int i = 0; i < numTargets; i++)
+    {
+        if (!ReadState(reader, puzzle, "end peg", endStates[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Class declaration for the output buffer
+//
+// Solutions are formatted into one growing character buffer (which keeps its
+// memory between flushes) and handed to the OS with a single write per
+// Flush, rather than going through iostreams with a flush per line.
+//
+//==============================================================================
+class OutputBuffer
+{
+public:
+    OutputBuffer(int fd) : fd(fd), used(0) { }
+
+    ~OutputBuffer() { Flush(); }
+
+    void Append(const char *text);
+    void AppendInt(int value);
+    void AppendMove(const Move& move);
+    void AppendSolution(int numMoves, const std::vector<Move>& moves);
+    void AppendNearest(int nearest, int numMoves, const std::vector<Move>& moves);
+    void AppendDistances(const std::vector<int>& distances);
+    size_t Size(void) { return used; }
+    bool Flush(void);
+
+private:
+    char *Reserve(size_t size);
+
+    // a negative fd discards everything (MPI processes other than the first)
+
+    int fd;
+    size_t used;
+    std::vector<char> data;
+};
+
+//==============================================================================
+//
+// Output Buffer Reserve
+//
+// make room for size more bytes and return where they go
+//
+//==============================================================================
+char *OutputBuffer::Reserve(size_t size)
+{
+    if (used + size > data.size())
+    {
+        data.resize(std::max(2*data.size(), used + size + OUTPUT_FLUSH_BYTES));
+    }
+    return &data[used];
+}
+
+//==============================================================================
+//
+// Output Buffer Append
+//
+//==============================================================================
+void OutputBuffer::Append(const char *text)
+{
+    size_t length = strlen(text);
+    memcpy(Reserve(length), text, length);
+    used += length;
+}
+
+void OutputBuffer::AppendInt(int value)
+{
+    char digits[12];
+    int numDigits = 0;
+    unsigned int magnitude = value < 0 ? 0u - (unsigned int)value : value;
+    do
+    {
+        digits[numDigits++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude);
+
+    char *dst = Reserve(numDigits + 1);
+    if (value < 0)
+    {
+        *dst++ = '-';
+        used++;
+    }
+    while (numDigits)
+    {
+        *dst++ = digits[--numDigits];
+        used++;
+    }
+}
+
+//==============================================================================
+//
+// Append Move
+//
+// format a "move" with one based peg numbers
+//
+//==============================================================================
+void OutputBuffer::AppendMove(const Move& move)
+{
+    AppendInt(move.fromPeg+1);
+    Append(" ");
+    AppendInt(move.toPeg+1);
+    Append("\n");
+}
+
+//==============================================================================
+//
+// Append Solution
+//
+// format the answer to one puzzle: the move count followed by the moves
+//
+//==============================================================================
+void OutputBuffer::AppendSolution(int numMoves, const std::vector<Move>& moves)
+{
+    Append("num moves = ");
+    AppendInt(numMoves);
+    Append("\n");
+
+    AppendInt(numMoves);
+    Append("\n");
+    for (size_t i = 0; i < moves.size(); i++)
+    {
+        AppendMove(moves[i]);
+    }
+}
+
+//==============================================================================
+//
+// Append Nearest / Append Distances
+//
+// The --targets answers: the (one based) index of the nearest end state
+// before its solution, or one line with the distance to every end state.
+//
+//==============================================================================
+void OutputBuffer::AppendNearest(int nearest, int numMoves, const std::vector<Move>& moves)
+{
+    Append("nearest target = ");
+    AppendInt(nearest >= 0 ? nearest+1 : -1);
+    Append("\n");
+    AppendSolution(numMoves, moves);
+}
+
+void OutputBuffer::AppendDistances(const std::vector<int>& distances)
+{
+    Append("distances =");
+    for (size_t i = 0; i < distances.size(); i++)
+    {
+        Append(" ");
+        AppendInt(distances[i]);
+    }
+    Append("\n");
+}
+
+//==============================================================================
+//
+// Output Buffer Flush
+//
+// write out everything buffered so far
+//
+//==============================================================================
+bool OutputBuffer::Flush(void)
+{
+    if (fd < 0)
+    {
+        used = 0;
+        return true;
+    }
+
+    size_t written = 0;
+    while (written < used)
+    {
+        ssize_t result = write(fd, &data[written], used - written);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (result <= 0)
+        {
+            used = 0;
+            return false;
+        }
+        written += result;
+    }
+    used = 0;
+    return true;
+}
+
+//==============================================================================
+//
+// Parse Options
+//
+// Handle the command line flags, returning false on anything unrecognized.
+//
+//==============================================================================
+typedef enum TargetMode
+{
+    kTargetMode_Single,
+    kTargetMode_Nearest,
+    kTargetMode_Distances
+} TargetMode;
+
+typedef struct Options
+{
+    SolverOptions solver;
+    TargetMode targetMode;
+    bool batch;
+    const char *graphFile;
+    const char *tableDir;
+    const char *buildTableDir;
+    const char *cacheFile;
+    bool cacheStats;
+    bool stats;
+    const char *inputFile;
+    int numJobs;
+    bool allDistances;
+    const char *distanceFile;
+    const char *patternDir;
+    const char *buildPatternDir;
+} Options;
+
+//==============================================================================
+//
+// Parse Number
+//
+// Read the whole-number argument of an option, reporting it unless it is a
+// plain decimal number between minValue and maxValue.
+//
+//==============================================================================
+static bool ParseNumber(const char *option, const char *text, long minValue, long maxValue,
+        long& value)
+{
+    char *end;
+    errno = 0;
+    value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value < minValue || value > maxValue)
+    {
+        std::cerr << option << " must be a number between " << minValue << " and "
+                  << maxValue << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool ParseOptions(int argc, char **argv, Options& options)
+{
+    options.solver = SolverOptions();
+    options.targetMode = kTargetMode_Single;
+    options.batch = false;
+    options.graphFile = NULL;
+    options.tableDir = NULL;
+    options.buildTableDir = NULL;
+    options.cacheFile = NULL;
+    options.cacheStats = false;
+    options.stats = false;
+    options.inputFile = NULL;
+    options.numJobs = 1;
+    options.allDistances = false;
+    options.distanceFile = NULL;
+    options.patternDir = NULL;
+    options.buildPatternDir = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bidirectional") == 0)
+        {
+            options.solver.bidirectional = true;
+        }
+        else if (strcmp(argv[i], "--symmetry") == 0)
+        {
+            options.solver.symmetry = true;
+        }
+        else if (strcmp(argv[i], "--search") == 0 && i+1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "bfs") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_Bfs;
+            }
+            else if (strcmp(name, "lean") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_Lean;
+            }
+            else if (strcmp(name, "external") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_External;
+            }
+            else if (strcmp(name, "distributed") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_Distributed;
+            }
+            else if (strcmp(name, "astar") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_AStar;
+            }
+            else if (strcmp(name, "idastar") == 0)
+            {
+                options.solver.algorithm = kSearchAlgorithm_IdaStar;
+            }
+            else
+            {
+                std::cerr << "unknown search: " << name << " (expected bfs, lean, external, distributed, astar or idastar)" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--targets") == 0 && i+1 < argc)
+        {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "nearest") == 0)
+            {
+                options.targetMode = kTargetMode_Nearest;
+            }
+            else if (strcmp(mode, "distances") == 0)
+            {
+                options.targetMode = kTargetMode_Distances;
+            }
+            else
+            {
+                std::cerr << "unknown target mode: " << mode << " (expected nearest or distances)" << std::endl;
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--sort-frontier") == 0)
+        {
+            options.solver.sortFrontier = true;
+        }
+        else if (strcmp(argv[i], "--max-moves") == 0 && i+1 < argc)
+        {
+            long maxMoves;
+            if (!ParseNumber(argv[i], argv[i+1], 0, INT_MAX, maxMoves))
+            {
+                return false;
+            }
+            options.solver.maxMoves = maxMoves;
+            i++;
+        }
+        else if (strcmp(argv[i], "--memory-budget") == 0 && i+1 < argc)
+        {
+            // megabytes, or a number with a K, M or G suffix
+            char *end;
+            double size = strtod(argv[++i], &end);
+            double unit = 1 << 20;
+            if (*end == 'K' || *end == 'k')
+            {
+                unit = 1 << 10;
+                end++;
+            }
+            else if (*end == 'M' || *end == 'm')
+            {
+                end++;
+            }
+            else if (*end == 'G' || *end == 'g')
+            {
+                unit = 1 << 30;
+                end++;
+            }
+            if (end == argv[i] || *end != '\0' || size < 0)
+            {
+                std::cerr << "bad --memory-budget " << argv[i] << std::endl;
+                return false;
+            }
+            options.solver.memoryBudget = (size_t)(size * unit);
+        }
+        else if (strcmp(argv[i], "--all-distances") == 0)
+        {
+            options.allDistances = true;
+        }
+        else if (strcmp(argv[i], "--distance-file") == 0 && i+1 < argc)
+        {
+            options.allDistances = true;
+            options.distanceFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--work-dir") == 0 && i+1 < argc)
+        {
+            options.solver.workDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--nodes") == 0 && i+1 < argc)
+        {
+            long numNodes;
+            if (!ParseNumber(argv[i], argv[i+1], 0, INT_MAX, numNodes))
+            {
+                return false;
+            }
+            options.solver.numNodes = numNodes;
+            i++;
+            if (options.solver.numNodes == 0)
+            {
+                options.solver.numNodes = std::max(1u, std::thread::hardware_concurrency());
+            }
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            options.batch = true;
+        }
+        else if (strcmp(argv[i], "--dump-graph") == 0 && i+1 < argc)
+        {
+            options.graphFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--tables") == 0 && i+1 < argc)
+        {
+            options.tableDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--build-tables") == 0 && i+1 < argc)
+        {
+            options.buildTableDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pdb") == 0 && i+1 < argc)
+        {
+            options.patternDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--build-pdb") == 0 && i+1 < argc)
+        {
+            options.buildPatternDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--pdb-disks") == 0 && i+1 < argc)
+        {
+            long patternDisks;
+            if (!ParseNumber(argv[i], argv[i+1], 1, MAX_PATTERN_DISKS, patternDisks))
+            {
+                return false;
+            }
+            options.solver.patternDisks = patternDisks;
+            i++;
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0 && i+1 < argc)
+        {
+            long cacheEntries;
+            if (!ParseNumber(argv[i], argv[i+1], 0, LONG_MAX, cacheEntries))
+            {
+                return false;
+            }
+            options.solver.cacheEntries = cacheEntries;
+            i++;
+        }
+        else if (strcmp(argv[i], "--cache-file") == 0 && i+1 < argc)
+        {
+            options.cacheFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-stats") == 0)
+        {
+            options.cacheStats = true;
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            options.stats = true;
+            options.solver.collectTimes = true;
+        }
+        else if (strcmp(argv[i], "--input") == 0 && i+1 < argc)
+        {
+            options.inputFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--search-threads") == 0 && i+1 < argc)
+        {
+            long searchThreads;
+            if (!ParseNumber(argv[i], argv[i+1], 0, INT_MAX, searchThreads))
+            {
+                return false;
+            }
+            options.solver.searchThreads = searchThreads;
+            i++;
+            if (options.solver.searchThreads == 0)
+            {
+                options.solver.searchThreads = std::max(1u, std::thread::hardware_concurrency());
+            }
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i+1 < argc)
+        {
+            long numJobs;
+            if (!ParseNumber(argv[i], argv[i+1], 0, INT_MAX, numJobs))
+            {
+                return false;
+            }
+            options.numJobs = numJobs;
+            i++;
+            if (options.numJobs == 0)
+            {
+                options.numJobs = std::max(1u, std::thread::hardware_concurrency());
+            }
+        }
+        else
+        {
+            std::cerr << "unknown option: " << argv[i] << std::endl;
+            std::cerr << "usage: " << argv[0]
+                      << " [--search bfs|lean|external|distributed|astar|idastar] [--bidirectional] [--symmetry]"
+                      << " [--sort-frontier] [--max-moves N] [--targets nearest|distances]"
+                      << " [--batch] [--dump-graph FILE]"
+                      << " [--tables DIR] [--build-tables DIR]"
+                      << " [--pdb DIR] [--build-pdb DIR] [--pdb-disks M]"
+                      << " [--cache-size N] [--cache-file FILE] [--cache-stats] [--stats]"
+                      << " [--input FILE] [--jobs N] [--search-threads N]"
+                      << " [--all-distances] [--distance-file FILE] [--work-dir DIR]"
+                      << " [--nodes N]" << std::endl;
+            return false;
+        }
+    }
+
+    options.solver.usePatternDatabases = options.patternDir != NULL;
+
+    if (options.graphFile && options.numJobs > 1 && options.batch)
+    {
+        std::cerr << "--dump-graph cannot be combined with a multi-threaded batch" << std::endl;
+        return false;
+    }
+    if (options.targetMode != kTargetMode_Single && options.batch && options.numJobs > 1)
+    {
+        std::cerr << "--targets cannot be combined with a multi-threaded batch" << std::endl;
+        return false;
+    }
+    if (options.graphFile && options.solver.algorithm != kSearchAlgorithm_Bfs)
+    {
+        std::cerr << "--dump-graph needs the graph built by --search bfs" << std::endl;
+        return false;
+    }
+    if (options.graphFile && options.solver.searchThreads > 1)
+    {
+        std::cerr << "--dump-graph cannot be combined with --search-threads" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+//==============================================================================
+//
+// Solve Puzzle
+//
+//==============================================================================
+static int SolvePuzzle(HanoiSolver& solver, const Puzzle& puzzle, std::vector<Move>& moves)
+{
+    // the reader has already checked the size, so this cannot fail
+    solver.Configure(puzzle.numDisks, puzzle.numPegs);
+    return solver.Solve(puzzle.startState, puzzle.endState, moves);
+}
+
+//==============================================================================
+//
+// Class declaration for the work stealing queue
+//
+// A double ended queue of tasks, each a range of puzzle indices. The owning
+// worker takes tasks from the back while idle workers steal from the front,
+// so the two mostly touch opposite ends of the queue.
+//
+//==============================================================================
+typedef struct BatchTask
+{
+    size_t first;
+    size_t last;
+} BatchTask;
+
+class WorkStealingQueue
+{
+public:
+    void Push(const BatchTask& task)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        tasks.push_back(task);
+    }
+
+    bool Pop(BatchTask& task)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.back();
+        tasks.pop_back();
+        return true;
+    }
+
+    bool Steal(BatchTask& task)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (tasks.empty())
+        {
+            return false;
+        }
+        task = tasks.front();
+        tasks.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex lock;
+    std::deque<BatchTask> tasks;
+};
+
+//==============================================================================
+//
+// Class declaration for the batch solver
+//
+// A fixed pool of worker threads solving independent puzzles. Every worker
+// owns its own solver and queue, so the only state shared
+// while solving is the read-only input, the mapped distance tables and the
+// per-puzzle result slots (each written by exactly one worker). Results are
+// stored by input position, so the caller can emit them in input order.
+//
+//==============================================================================
+typedef struct PuzzleResult
+{
+    int numMoves;
+    std::vector<Move> moves;
+} PuzzleResult;
+
+class BatchSolver
+{
+public:
+    BatchSolver(const SolverOptions& options, int numWorkers);
+
+    ~BatchSolver();
+
+    void Solve(const std::vector<Puzzle>& puzzles, std::vector<PuzzleResult>& results);
+    void SeedCaches(const HanoiSolver& solver);
+    void MergeCaches(HanoiSolver& solver);
+    void MergeStats(SearchStats& stats);
+
+private:
+    typedef struct Worker
+    {
+        Worker(const SolverOptions& options) : solver(options) { }
+
+        HanoiSolver solver;
+        WorkStealingQueue queue;
+        std::thread thread;
+    } Worker;
+
+    void WorkerLoop(int index);
+    void RunTasks(int index);
+
+    std::vector<Worker *> workers;
+
+    // the batch currently being solved
+    const std::vector<Puzzle> *puzzles;
+    std::vector<PuzzleResult> *results;
+
+    // workers sleep until generation changes, then solve that batch
+    std::mutex lock;
+    std::condition_variable startCondition;
+    std::condition_variable doneCondition;
+    int generation;
+    int numBusy;
+    bool stopping;
+};
+
+//==============================================================================
+//
+// Batch Solver Constructor
+//
+// start the worker threads, which idle until the first batch arrives
+//
+//==============================================================================
+BatchSolver::BatchSolver(const SolverOptions& options, int numWorkers) :
+    puzzles(NULL), results(NULL), generation(0), numBusy(0), stopping(false)
+{
+    for (int i = 0; i < numWorkers; i++)
+    {
+        workers.push_back(new Worker(options));
+    }
+    for (int i = 0; i < numWorkers; i++)
+    {
+        workers[i]->thread = std::thread(&BatchSolver::WorkerLoop, this, i);
+    }
+}
+
+//==============================================================================
+//
+// Batch Solver Destructor
+//
+//==============================================================================
+BatchSolver::~BatchSolver()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    startCondition.notify_all();
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i]->thread.join();
+        delete workers[i];
+    }
+}
+
+//==============================================================================
+//
+// Seed Caches / Merge Caches / Merge Stats
+//
+// Give every worker a copy of a loaded cache before solving, and fold what
+// the workers learned (plus their hit counts and search stats) back into one
+// total after.
+//
+//==============================================================================
+void BatchSolver::SeedCaches(const HanoiSolver& solver)
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        workers[i]->solver.MergeCache(solver);
+    }
+}
+
+void BatchSolver::MergeCaches(HanoiSolver& solver)
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        solver.MergeCache(workers[i]->solver);
+    }
+}
+
+void BatchSolver::MergeStats(SearchStats& stats)
+{
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+        SearchStats workerStats;
+        workers[i]->solver.GetStats(workerStats);
+        AddSearchStats(stats, workerStats);
+    }
+}
+
+//==============================================================================
+//
+// Batch Solver Solve
+//
+// Split the batch into tasks, deal them out to the workers in contiguous
+// blocks and wait until every puzzle has been solved.
+//
+//==============================================================================
+void BatchSolver::Solve(const std::vector<Puzzle>& puzzles, std::vector<PuzzleResult>& results)
+{
+    results.resize(puzzles.size());
+    this->puzzles = &puzzles;
+    this->results = &results;
+
+    size_t numTasks = (puzzles.size() + BATCH_TASK_PUZZLES - 1) / BATCH_TASK_PUZZLES;
+    for (size_t task = 0; task < numTasks; task++)
+    {
+        BatchTask batchTask;
+        batchTask.first = task * BATCH_TASK_PUZZLES;
+        batchTask.last = std::min(batchTask.first + BATCH_TASK_PUZZLES, puzzles.size());
+        workers[task * workers.size() / numTasks]->queue.Push(batchTask);
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    numBusy = workers.size();
+    generation++;
+    startCondition.notify_all();
+    while (numBusy > 0)
+    {
+        doneCondition.wait(guard);
+    }
+}
+
+//==============================================================================
+//
+// Worker Loop
+//
+//==============================================================================
+void BatchSolver::WorkerLoop(int index)
+{
+    int seenGeneration = 0;
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            while (generation == seenGeneration && !stopping)
+            {
+                startCondition.wait(guard);
+            }
+            if (stopping)
+            {
+                return;
+            }
+            seenGeneration = generation;
+        }
+
+        RunTasks(index);
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (--numBusy == 0)
+        {
+            doneCondition.notify_all();
+        }
+    }
+}
+
+//==============================================================================
+//
+// Run Tasks
+//
+// Drain this worker's own queue, then steal from the others. No tasks are
+// added while a batch runs, so once every queue is empty the worker is done.
+//
+//==============================================================================
+void BatchSolver::RunTasks(int index)
+{
+    Worker *worker = workers[index];
+    for (;;)
+    {
+        BatchTask task;
+        bool found = worker->queue.Pop(task);
+        for (size_t i = 1; !found && i < workers.size(); i++)
+        {
+            found = workers[(index + i) % workers.size()]->queue.Steal(task);
+        }
+        if (!found)
+        {
+            return;
+        }
+
+        for (size_t i = task.first; i < task.last; i++)
+        {
+            PuzzleResult& result = (*results)[i];
+            result.numMoves = SolvePuzzle(worker->solver, (*puzzles)[i], result.moves);
+        }
+    }
+}
+
+//==============================================================================
+//
+// Class declaration for the phase timer
+//
+// Adds up the time spent between Start and Stop calls, for --stats. When
+// disabled it never reads the clock.
+//
+//==============================================================================
+class PhaseTimer
+{
+public:
+    PhaseTimer(bool enabled) : seconds(0), enabled(enabled), started(0) { }
+
+    void Start(void)
+    {
+        if (enabled)
+        {
+            started = CurrentSeconds();
+        }
+    }
+
+    void Stop(void)
+    {
+        if (enabled)
+        {
+            seconds += CurrentSeconds() - started;
+        }
+    }
+
+    double seconds;
+
+private:
+    bool enabled;
+    double started;
+};
+
+//==============================================================================
+//
+// Print Stats
+//
+// Report --stats on STDERR. With several jobs the search and path times are
+// summed over the workers, so they can exceed the elapsed time.
+//
+//==============================================================================
+static void PrintStats(const SearchStats& stats, double parseSeconds, double outputSeconds)
+{
+    std::cerr << "queries = " << stats.numQueries
+              << ", searches = " << stats.numSearches
+              << ", budget fallbacks = " << stats.budgetFallbacks << std::endl;
+    std::cerr << "vertices = " << stats.verticesCreated
+              << ", expanded = " << stats.statesExpanded
+              << ", edges = " << stats.edgesGenerated
+              << ", duplicates = " << stats.duplicateHits
+              << ", frontier peak = " << stats.frontierPeak << std::endl;
+    std::cerr << "parse = " << parseSeconds << " s, search = " << stats.searchSeconds
+              << " s, paths = " << stats.pathSeconds << " s, output = " << outputSeconds
+              << " s" << std::endl;
+}
+
+//==============================================================================
+//
+// Run Solver
+//
+// Everything main does between starting and stopping MPI, if it is used.
+//
+//==============================================================================
+static int RunSolver(int argc, char **argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        return 1;
+    }
+
+    // under mpirun, every process reads the same input and makes the same
+    // calls, taking part in each distributed search; only the first writes
+    bool isRoot = true;
+#ifdef FBHANOI_USE_MPI
+    int rank;
+    if (JoinMpiWorld(rank) > 1)
+    {
+        if (options.solver.algorithm != kSearchAlgorithm_Distributed || !options.inputFile ||
+                (options.batch && options.numJobs > 1) || options.allDistances ||
+                options.targetMode != kTargetMode_Single)
+        {
+            std::cerr << "running on several MPI processes needs --search distributed,"
+                      << " --input FILE and a single job" << std::endl;
+            return 1;
+        }
+        isRoot = rank == 0;
+    }
+#endif
+
+    if (options.buildTableDir)
+    {
+        return BuildDistanceTables(options.buildTableDir) ? 0 : 1;
+    }
+    if (options.buildPatternDir)
+    {
+        return BuildPatternDatabases(options.buildPatternDir) ? 0 : 1;
+    }
+    if (options.tableDir)
+    {
+        LoadDistanceTables(options.tableDir);
+    }
+    if (options.patternDir)
+    {
+        LoadPatternDatabases(options.patternDir);
+    }
+
+    PhaseTimer parseTimer(options.stats);
+    PhaseTimer outputTimer(options.stats);
+
+    InputReader reader;
+    parseTimer.Start();
+    if (!reader.Open(options.inputFile))
+    {
+        return 1;
+    }
+    parseTimer.Stop();
+
+    // analysis mode: layer statistics from the first puzzle's start state
+    if (options.allDistances)
+    {
+        Puzzle puzzle;
+        if (!ReadPuzzle(reader, puzzle))
+        {
+            if (!reader.failed)
+            {
+                std::cerr << "no puzzle found in input" << std::endl;
+            }
+            return 1;
+        }
+        return ExploreAllDistances(puzzle.numDisks, puzzle.numPegs, puzzle.startState,
+                options.distanceFile, stdout) ? 0 : 1;
+    }
+
+    HanoiSolver solver(options.solver);
+    if (options.cacheFile)
+    {
+        solver.LoadCache(options.cacheFile);
+    }
+
+    OutputBuffer output(isRoot ? 1 : -1);
+    std::vector<Move> moves;
+    Puzzle puzzle;
+    int numPuzzles = 0;
+    SearchStats stats = SearchStats();
+    if (options.batch && options.numJobs > 1)
+    {
+        // read a chunk of puzzles, solve it across the worker pool, then
+        // write the results out in input order
+        BatchSolver batchSolver(options.solver, options.numJobs);
+        batchSolver.SeedCaches(solver);
+
+        std::vector<Puzzle> puzzles;
+        std::vector<PuzzleResult> results;
+        puzzles.reserve(BATCH_CHUNK_PUZZLES);
+        bool more = true;
+        while (more)
+        {
+            puzzles.clear();
+            parseTimer.Start();
+            while (puzzles.size() < BATCH_CHUNK_PUZZLES && (more = ReadPuzzle(reader, puzzle)))
+            {
+                puzzles.push_back(puzzle);
+            }
+            parseTimer.Stop();
+
+            batchSolver.Solve(puzzles, results);
+            outputTimer.Start();
+            for (size_t i = 0; i < puzzles.size(); i++)
+            {
+                output.AppendSolution(results[i].numMoves, results[i].moves);
+                if (output.Size() >= OUTPUT_FLUSH_BYTES)
+                {
+                    output.Flush();
+                }
+            }
+            outputTimer.Stop();
+            numPuzzles += puzzles.size();
+        }
+
+        // start from an empty cache so the seeded entries are not counted twice
+        solver.ClearCache();
+        batchSolver.MergeCaches(solver);
+        batchSolver.MergeStats(stats);
+    }
+    else
+    {
+        // in batch mode keep solving puzzles until the input runs out,
+        // reusing the one graph (and all of its buffers) for every query
+        std::vector<StateCode> endStates;
+        std::vector<int> distances;
+        for (;;)
+        {
+            parseTimer.Start();
+            bool more = options.targetMode == kTargetMode_Single ? ReadPuzzle(reader, puzzle) :
+                ReadTargetPuzzle(reader, puzzle, endStates);
+            parseTimer.Stop();
+            if (!more)
+            {
+                break;
+            }
+
+            if (options.targetMode == kTargetMode_Single)
+            {
+                int numMoves = SolvePuzzle(solver, puzzle, moves);
+                outputTimer.Start();
+                output.AppendSolution(numMoves, moves);
+                outputTimer.Stop();
+            }
+            else if (options.targetMode == kTargetMode_Nearest)
+            {
+                int nearest;
+                solver.Configure(puzzle.numDisks, puzzle.numPegs);
+                int numMoves = solver.SolveNearest(puzzle.startState, endStates, moves, nearest);
+                outputTimer.Start();
+                output.AppendNearest(nearest, numMoves, moves);
+                outputTimer.Stop();
+            }
+            else
+            {
+                solver.Configure(puzzle.numDisks, puzzle.numPegs);
+                solver.SolveDistances(puzzle.startState, endStates, distances);
+                outputTimer.Start();
+                output.AppendDistances(distances);
+                outputTimer.Stop();
+            }
+
+            numPuzzles++;
+            if (!options.batch)
+            {
+                break;
+            }
+            if (output.Size() >= OUTPUT_FLUSH_BYTES)
+            {
+                outputTimer.Start();
+                output.Flush();
+                outputTimer.Stop();
+            }
+        }
+        solver.GetStats(stats);
+    }
+    outputTimer.Start();
+    output.Flush();
+    outputTimer.Stop();
+
+    if (options.stats && isRoot)
+    {
+        PrintStats(stats, parseTimer.seconds, outputTimer.seconds);
+    }
+
+    if (options.cacheStats && isRoot)
+    {
+        size_t hits, misses;
+        solver.GetCacheStats(hits, misses);
+        std::cerr << "cache hits = " << hits << ", misses = " << misses << std::endl;
+    }
+
+    bool ok = numPuzzles > 0 && !reader.failed;
+    if (numPuzzles == 0 && !reader.failed)
+    {
+        std::cerr << "no puzzle found in input" << std::endl;
+    }
+
+    // the dump covers the last puzzle, which must have searched the graph
+    if (ok && options.graphFile)
+    {
+        ok = solver.DumpGraph(options.graphFile);
+    }
+    if (ok && options.cacheFile && isRoot)
+    {
+        ok = solver.SaveCache(options.cacheFile);
+    }
+
+    return ok ? 0 : 1;
+}
+
+//==============================================================================
+//
+// main
+//
+//==============================================================================
+int main(int argc, char **argv)
+{
+#ifdef FBHANOI_USE_MPI
+    MPI_Init(&argc, &argv);
+    int result = RunSolver(argc, argv);
+    MPI_Finalize();
+    return result;
+#else
+    return RunSolver(argc, argv);
+#endif
+}